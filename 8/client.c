@@ -1,82 +1,182 @@
-#include <stdio.h>      /* for printf() and fprintf() */
-#include <sys/socket.h> /* for socket(), connect(), send(), and recv() */
-#include <arpa/inet.h>  /* for sockaddr_in and inet_addr() */
-#include <stdlib.h>     /* for atoi() and exit() */
-#include <string.h>     /* for memset() */
-#include <unistd.h>     /* for close() */
+#include <stdio.h>  /* for printf() and fprintf() */
+#include <stdlib.h> /* for atoi() and exit() */
+#include <unistd.h> /* for getpid() and getopt() */
 #include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
 
-int sock; /* Socket descriptor */
+#include "libsalon.h"
+#include "trace.h"
+
+struct Salon *salon;
+uint32_t ticket;  /* Of the visit, 0 until asked for */
+int leavePipe[2]; /* Written by sigfunc(), polled along with the salon */
 
 void DieWithError(char *errorMessage)
 {
-    close(sock);
+    if (salon != NULL)
+        SalonClose(salon);
     perror(errorMessage);
     exit(0);
 }
 
+/* Only wakes up main(), which leaves when it sees the pipe readable */
 void sigfunc(int sig)
 {
-    if (sig != SIGINT && sig != SIGTERM)
+    int saved = errno;
+    char c = sig;
+
+    if (sig == SIGINT || sig == SIGTERM)
+        write(leavePipe[1], &c, 1);
+    errno = saved;
+}
+
+void Leave()
+{
+    /* Don't leave the hairdresser to cut nobody's hair */
+    if (salon != NULL)
     {
-        return;
+        int status = ticket != 0 ? SalonStatus(salon, ticket) : VISIT_DONE;
+        if (status != VISIT_DONE && status != VISIT_REJECTED && status != VISIT_CANCELLED && status != VISIT_LIMITED)
+            SalonCancel(salon, ticket);
+        SalonClose(salon);
     }
-
-    close(sock);
+    TraceClose();
     printf("disconnected\n");
     exit(0);
 }
 
 int main(int argc, char *argv[])
 {
+    if (pipe(leavePipe) < 0)
+        DieWithError("pipe() failed");
     signal(SIGINT, sigfunc);
     signal(SIGTERM, sigfunc);
 
-    struct sockaddr_in servAddr; /* Echo server address */
-    unsigned short servPort;     /* Echo server port */
-    char *servIP;                /* Server IP address */
-    pid_t pid;                   /* String to send to echo server */
-    int bytesRcvd;               /* Bytes read in single recv() */
+    pid_t pid; /* Visitor id */
+    int status = -1;
+    int sync = 0;
+    uint32_t salonId = 0;
+    long patienceMs = 0; /* Longest wait in the queue, 0 for no limit */
+    int party = 1;
+    pid_t visitors[MAX_GROUP];
+    int opt;
 
-    if ((argc < 3) || (argc > 4)) /* Test for correct number of arguments */
+    while ((opt = getopt(argc, argv, "Si:p:g:")) != -1)
     {
-        fprintf(stderr, "Usage: %s <Server IP> <Echo Word> [<Echo Port>]\n",
+        if (opt == 'S')
+            sync = 1;
+        else if (opt == 'i')
+            salonId = strtoul(optarg, NULL, 10);
+        else if (opt == 'p')
+            patienceMs = atol(optarg);
+        else if (opt == 'g')
+            party = atoi(optarg);
+        else
+            argc = 0;
+    }
+    if (argc - optind != 2 || party < 1 || party > MAX_GROUP) /* Test for correct number of arguments */
+    {
+        fprintf(stderr,
+                "Usage: %s [-S] [-i <salon id>] [-p <patience, ms>] [-g <party size>] <Server IP> <Server Port | "
+                "unix:<path>>\n",
                 argv[0]);
+        fprintf(stderr, "-S: estimate the offset of the server's clock first\n");
+        fprintf(stderr, "-i: which salon of the server to visit, 0 by default\n");
+        fprintf(stderr, "-p: give up if not in the chair after this long\n");
+        fprintf(stderr, "-g: come with friends, up to %d in all, and leave when the last is done\n", MAX_GROUP);
         exit(1);
     }
+    argv += optind - 1;
 
-    servIP = argv[1];
     pid = getpid();
-    servPort = atoi(argv[2]);
-
-    /* Create a reliable, stream socket using TCP */
-    if ((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
-    {
-        DieWithError("socket() failed");
-    }
+    /* Friends need ids of their own, above any pid */
+    for (int i = 0; i < party; i++)
+        visitors[i] = pid + i * (1 << 22);
+    TraceOpen(NULL, "client");
 
-    /* Construct the server address structure */
-    memset(&servAddr, 0, sizeof(servAddr));       /* Zero out structure */
-    servAddr.sin_family = AF_INET;                /* Internet address family */
-    servAddr.sin_addr.s_addr = inet_addr(servIP); /* Server IP address */
-    servAddr.sin_port = htons(servPort);          /* Server port */
+    /* Second arg may be unix:<path> instead of a port */
+    if ((salon = SalonOpen(argv[1], argv[2])) == NULL)
+        DieWithError("Hairdresser's is closed");
+    SalonSetId(salon, salonId);
 
-    if (connect(sock, (struct sockaddr *)&servAddr, sizeof(servAddr)) < 0)
+    if (sync)
     {
-        DieWithError("Hairdresser's is closed");
+        struct pollfd in[2] = {{SalonFd(salon), POLLIN, 0}, {leavePipe[0], POLLIN, 0}};
+        int64_t offset;
+        for (int i = 0; i < SYNC_PROBES; i++)
+        {
+            if (SalonSync(salon) < 0 || poll(in, 2, 1000) <= 0)
+                continue;
+            if (in[1].revents & POLLIN)
+                Leave();
+            if (SalonProcess(salon) < 0)
+                DieWithError("recv() failed or connection closed prematurely");
+        }
+        if (SalonClockOffset(salon, &offset) == 0)
+            printf("Client %d: server clock is %lld ns ahead\n", pid, (long long)offset);
+        else
+            printf("Client %d: no answer about the clock\n", pid);
     }
 
-    if (send(sock, &pid, sizeof(int), 0) != sizeof(int))
+    uint64_t start = TraceNow();
+    TraceFlow('s', start, pid);
+    struct pollfd pfd[2] = {{SalonFd(salon), POLLOUT, 0}, {leavePipe[0], POLLIN, 0}};
+    while ((party > 1 ? SalonVisitGroup(salon, visitors, party, 1, &ticket) : SalonVisit(salon, pid, &ticket)) < 0)
     {
-        DieWithError("send() in client sent a different number of bytes than expected");
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            DieWithError("send() in client failed");
+        poll(pfd, 2, -1);
+        if (pfd[1].revents & POLLIN)
+            Leave();
     }
-    printf("Client %d went to hairdresser's\n", getpid());
+    if (party > 1)
+        printf("Client %d went to hairdresser's with %d friends\n", pid, party - 1);
+    else
+        printf("Client %d went to hairdresser's\n", pid);
 
-    if ((bytesRcvd = recv(sock, &pid, sizeof(int), 0)) <= 0)
+    /* One visit, so just wait for it to end, or for our patience to */
+    struct timespec now, giveUpAt;
+    clock_gettime(CLOCK_MONOTONIC, &giveUpAt);
+    giveUpAt.tv_sec += patienceMs / 1000;
+    giveUpAt.tv_nsec += patienceMs % 1000 * 1000000;
+    pfd[0].events = POLLIN;
+    while (status != VISIT_DONE && status != VISIT_REJECTED && status != VISIT_CANCELLED && status != VISIT_LIMITED)
     {
-        DieWithError("recv() failed or connection closed prematurely");
+        int timeout = -1;
+        if (patienceMs > 0 && status != VISIT_IN_CHAIR)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long leftMs = (giveUpAt.tv_sec - now.tv_sec) * 1000 + (giveUpAt.tv_nsec - now.tv_nsec) / 1000000;
+            if (leftMs <= 0)
+            {
+                printf("Client %d ran out of patience\n", pid);
+                SalonCancel(salon, ticket);
+                patienceMs = 0; /* Now it's the server's turn: cancelled, or too late */
+            }
+            else
+                timeout = leftMs;
+        }
+        if (poll(pfd, 2, timeout) < 0 && errno != EINTR)
+            DieWithError("poll() failed");
+        if (pfd[1].revents & POLLIN)
+            Leave();
+        if (SalonProcess(salon) < 0)
+            DieWithError("recv() failed or connection closed prematurely");
+        status = SalonStatus(salon, ticket);
     }
-    printf("Client %d left\n", pid);
-    close(sock);
+    if (status == VISIT_REJECTED)
+        printf("Client %d was turned away\n", pid);
+    else if (status == VISIT_LIMITED)
+        printf("Client %d was rate limited\n", pid);
+    else if (status == VISIT_CANCELLED)
+        printf("Client %d gave up waiting\n", pid);
+    else
+        printf("Client %d left\n", pid);
+    TraceFlow('f', TraceNow(), pid);
+    TraceSlice("visit", start, pid);
+    TraceClose();
+    SalonClose(salon);
     exit(0);
 }
@@ -1,13 +1,44 @@
 #include <stdio.h>      /* for printf() and fprintf() */
 #include <sys/socket.h> /* for socket(), connect(), send(), and recv() */
 #include <arpa/inet.h>  /* for sockaddr_in and inet_addr() */
-#include <stdlib.h>     /* for atoi() and exit() */
+#include <stdlib.h>     /* for atoi(), calloc() and exit() */
 #include <string.h>     /* for memset() */
 #include <unistd.h>     /* for close() */
+#include <getopt.h>     /* for getopt_long() */
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+
+#include "transport.h"
+#include "salon.h"
+#include "trace.h"
 
 int sock; /* Socket descriptor */
 
+/* One process cuts in several chairs at once, driven by a single poll()
+   timeout: the next haircut to finish or the next heartbeat, whichever is first */
+struct Seat
+{
+    int busy;
+    struct JobDone done;    /* Filled in as the haircut goes */
+    struct timespec since;  /* When it started */
+    long left;              /* ms until done, as of the last Tick() */
+    uint64_t traceStart;
+    unsigned long haircuts;
+    long busyMs;
+};
+
+struct Seat *seats;
+int chairCount = 1;
+int busyCount;
+uint32_t salonId; /* Of the salons the server hosts */
+struct timespec openedAt;
+
+/* Added to our CLOCK_MONOTONIC gives the server's, with -S */
+int64_t offset;
+uint32_t stampFlags;
+
 void DieWithError(char *errorMessage)
 {
     close(sock);
@@ -15,6 +46,153 @@ void DieWithError(char *errorMessage)
     exit(0);
 }
 
+long ElapsedMs(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/* Tell the server we are alive: our chairs while all are free, none while cutting */
+void Heartbeat()
+{
+    struct Register reg = {REGISTER_MAGIC, busyCount == 0 ? chairCount : 0, salonId, getpid()};
+
+    if (send(sock, &reg, sizeof(reg), 0) != sizeof(reg))
+        DieWithError("send() of a heartbeat failed");
+}
+
+/* Chairs of their own in the trace, the main thread's when there is only one */
+int SeatTrack(int chair)
+{
+    return chairCount > 1 ? chair + 1 : 0;
+}
+
+void StartHaircut(const struct Job *job)
+{
+    if (job->chair >= (uint32_t)chairCount || seats[job->chair].busy)
+    {
+        printf("Chair %u is not free for client %d\n", job->chair, job->visitor);
+        return;
+    }
+    struct Seat *seat = &seats[job->chair];
+    StampNow(&seat->done.received, offset, stampFlags);
+    seat->done.visitor = job->visitor;
+    seat->done.chair = job->chair;
+    seat->done.salon = salonId;
+    seat->done.echo = job->sent;
+    seat->busy = 1;
+    seat->left = HAIRCUT_MS;
+    clock_gettime(CLOCK_MONOTONIC, &seat->since);
+    busyCount++;
+
+    if (chairCount > 1)
+        printf("Client %d is getting a haircut in chair %u\n", job->visitor, job->chair);
+    else
+        printf("Client %d is getting a haircut\n", job->visitor); /* Print the echo buffer */
+
+    seat->traceStart = TraceNow();
+    TraceTrack(SeatTrack(job->chair));
+    TraceFlow('t', seat->traceStart, job->visitor);
+    TraceTrack(0);
+}
+
+void FinishHaircut(int chair)
+{
+    struct Seat *seat = &seats[chair];
+    pid_t pid = seat->done.visitor;
+
+    TraceTrack(SeatTrack(chair));
+    TraceSlice("haircut", seat->traceStart, pid);
+    TraceTrack(0);
+
+    /* Send the string to the server */
+    StampNow(&seat->done.sent, offset, stampFlags);
+    if (send(sock, &seat->done, sizeof(seat->done), 0) != sizeof(seat->done))
+        DieWithError("send() sent a different number of bytes than expected");
+
+    seat->busy = 0;
+    seat->haircuts++;
+    seat->busyMs += ElapsedMs(&seat->since);
+    busyCount--;
+    if (chairCount > 1)
+        printf("Client %d haircut in chair %d is finnished\n", pid, chair);
+    else
+        printf("Client %d haircut is finnished\n", pid); /* Print the echo buffer */
+    if (busyCount == 0)
+        printf("Hairdresser is sleeping.\n");
+}
+
+/* Finish what is due. Returns ms until the next haircut is done, -1 if none is going on */
+long Tick()
+{
+    long next = -1;
+
+    for (int c = 0; c < chairCount; c++)
+    {
+        if (!seats[c].busy)
+            continue;
+        seats[c].left = HAIRCUT_MS - ElapsedMs(&seats[c].since);
+        if (seats[c].left <= 0)
+            FinishHaircut(c);
+        else if (next < 0 || seats[c].left < next)
+            next = seats[c].left;
+    }
+    return next;
+}
+
+/* Share of the time since opening each chair spent cutting */
+void ReportUtilization()
+{
+    long openMs = ElapsedMs(&openedAt);
+    long totalMs = 0;
+
+    if (openMs <= 0)
+        return;
+    for (int c = 0; c < chairCount; c++)
+    {
+        long busyMs = seats[c].busyMs + (seats[c].busy ? ElapsedMs(&seats[c].since) : 0);
+        totalMs += busyMs;
+        if (chairCount > 1)
+            printf("Chair %d: %lu haircuts, busy %.1f%%\n", c, seats[c].haircuts, 100.0 * busyMs / openMs);
+    }
+    printf("Utilization %.1f%% of %d chair%s over %ld ms\n", 100.0 * totalMs / openMs / chairCount, chairCount,
+           chairCount > 1 ? "s" : "", openMs);
+}
+
+/* NTP-style: of SYNC_PROBES exchanges, trust the one with the shortest round trip */
+void SyncClock()
+{
+    struct ClockSync sync;
+    struct Stamp now;
+    struct pollfd pfd = {sock, POLLIN, 0};
+    int64_t rtt, best = 0;
+
+    for (int i = 0; i < SYNC_PROBES; i++)
+    {
+        memset(&sync, 0, sizeof(sync));
+        sync.magic = SYNC_MAGIC;
+        StampNow(&now, 0, 0);
+        sync.t1 = now.mono;
+        if (send(sock, &sync, sizeof(sync), 0) != sizeof(sync))
+            DieWithError("send() of a clock probe failed");
+        if (poll(&pfd, 1, 1000) <= 0 || recv(sock, &sync, sizeof(sync), 0) != sizeof(sync) || sync.magic != SYNC_MAGIC)
+            continue;
+        StampNow(&now, 0, 0);
+        int64_t o = SyncOffset(&sync, now.mono, &rtt);
+        if (best == 0 || rtt < best)
+        {
+            best = rtt > 0 ? rtt : 1;
+            offset = o;
+            stampFlags = STAMP_SYNCED;
+        }
+    }
+    if (stampFlags & STAMP_SYNCED)
+        printf("Server clock is %lld ns ahead, round trip %lld ns\n", (long long)offset, (long long)best);
+    else
+        printf("No answer about the clock\n");
+}
+
 void sigfunc(int sig)
 {
     if (sig != SIGINT && sig != SIGTERM)
@@ -23,6 +201,9 @@ void sigfunc(int sig)
     }
 
     close(sock);
+    TraceClose();
+    if (seats != NULL)
+        ReportUtilization();
     printf("disconnected\n");
     exit(0);
 }
@@ -32,58 +213,91 @@ int main(int argc, char *argv[])
     signal(SIGINT, sigfunc);
     signal(SIGTERM, sigfunc);
 
-    struct sockaddr_in servAddr; /* Echo server address */
-    unsigned short servPort;     /* Echo server port */
-    char *servIP;                /* Server IP address  */
-    pid_t pid;
+    struct Endpoint servEp; /* Server address */
+    struct Job job;
     int bytesRcvd; /* Bytes read in single recv() */
+    int sync = 0;
+    int opt;
+    static const struct option longOpts[] = {
+        {"chairs", required_argument, NULL, 'k'}, {"salon", required_argument, NULL, 'i'}, {NULL, 0, NULL, 0}};
 
-    if (argc != 3) /* Test for correct number of arguments */
+    while ((opt = getopt_long(argc, argv, "Sk:i:", longOpts, NULL)) != -1)
+    {
+        if (opt == 'S')
+            sync = 1;
+        else if (opt == 'k')
+            chairCount = atoi(optarg);
+        else if (opt == 'i')
+            salonId = strtoul(optarg, NULL, 10);
+        else
+            argc = 0;
+    }
+    if (argc - optind != 2 || chairCount < 1 || chairCount > MAX_CHAIRS) /* Test for correct number of arguments */
     {
-        fprintf(stderr, "Usage: %s <Server IP> <Echo Port>\n",
+        fprintf(stderr, "Usage: %s [-S] [--chairs <K>] [--salon <id>] <Server IP> <Server Port | unix:<path>>\n",
                 argv[0]);
+        fprintf(stderr, "-S: estimate the offset of the server's clock first\n");
+        fprintf(stderr, "--chairs, -k: cut in up to K chairs at once, at most %d\n", MAX_CHAIRS);
+        fprintf(stderr, "--salon, -i: which salon of the server to work in, 0 by default\n");
         exit(-1);
     }
+    if ((seats = calloc(chairCount, sizeof(*seats))) == NULL)
+    {
+        perror("calloc() failed");
+        exit(-1);
+    }
+    argv += optind - 1;
 
-    servIP = argv[1];         /* First arg: server IP address (dotted quad) */
-    servPort = atoi(argv[2]); /* port */
-
-    /* Create a reliable, stream socket using TCP */
-    if ((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
-        DieWithError("socket() failed");
+    TraceOpen(NULL, "hairdresser");
 
-    /* Construct the server address structure */
-    memset(&servAddr, 0, sizeof(servAddr));       /* Zero out structure */
-    servAddr.sin_family = AF_INET;                /* Internet address family */
-    servAddr.sin_addr.s_addr = inet_addr(servIP); /* Server IP address */
-    servAddr.sin_port = htons(servPort);          /* Server port */
+    /* Second arg may be unix:<path> instead of a port */
+    if (ParseEndpoint(argv[1], argv[2], &servEp) < 0)
+        DieWithError("Invalid address");
 
-    /* Establish the connection to the server */
-    if (connect(sock, (struct sockaddr *)&servAddr, sizeof(servAddr)) < 0)
+    /* Create a socket connected to the server */
+    if ((sock = TransportConnect(&servEp)) < 0)
         DieWithError("connect() failed");
-        
-    int h = 0;
-    if (sendto(sock, &h, sizeof(int), 0, (struct sockaddr *)&servAddr, sizeof(servAddr)) != sizeof(int))
-    {
-        DieWithError("sendto() sent to the hairdresser a different number of bytes than expected");
-    }
+
+    if (sync)
+        SyncClock();
+
+    /* Registration is the idle heartbeat */
+    Heartbeat();
+    clock_gettime(CLOCK_MONOTONIC, &openedAt);
     printf("Hairdresser's is open\n");
+    printf("Hairdresser is sleeping.\n"); // Setup to print the echoed string
 
+    struct timespec beatAt = openedAt;
+    struct pollfd pfd = {sock, POLLIN, 0};
     for (;;)
     {
-        printf("Hairdresser is sleeping.\n"); // Setup to print the echoed string
+        /* Even asleep, keep telling the server we are here */
+        long next = Tick();
+        long beat = HEARTBEAT_MS - ElapsedMs(&beatAt);
+        if (beat <= 0)
+        {
+            Heartbeat();
+            clock_gettime(CLOCK_MONOTONIC, &beatAt);
+            beat = HEARTBEAT_MS;
+        }
+        if (next < 0 || beat < next)
+            next = beat;
+        if (poll(&pfd, 1, next) <= 0)
+            continue;
 
-        if ((bytesRcvd = recv(sock, &pid, sizeof(int), 0)) <= 0)
+        /* Every job that came, without blocking */
+        while ((bytesRcvd = recv(sock, &job, sizeof(job), MSG_DONTWAIT)) != 0)
+        {
+            if (bytesRcvd < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                    break;
+                DieWithError("recv() failed or connection closed prematurely");
+            }
+            if (bytesRcvd == sizeof(job)) /* Otherwise a late answer about the clock */
+                StartHaircut(&job);
+        }
+        if (bytesRcvd == 0)
             DieWithError("recv() failed or connection closed prematurely");
-
-        printf("Client %d is getting a haircut\n", pid); /* Print the echo buffer */
-
-        sleep(3);
-
-        /* Send the string to the server */
-        if (send(sock, &pid, sizeof(int), 0) != sizeof(int))
-            DieWithError("send() sent a different number of bytes than expected");
-
-        printf("Client %d haircut is finnished\n", pid); /* Print the echo buffer */
     }
 }
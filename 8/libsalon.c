@@ -0,0 +1,432 @@
+#include <sys/socket.h> /* for send() and recv() */
+#include <netinet/in.h> /* for sockaddr_in */
+#include <stdlib.h>     /* for malloc() and free() */
+#include <string.h>     /* for memset() */
+#include <unistd.h>     /* for close() */
+#include <errno.h>
+
+#include "libsalon.h"
+#include "transport.h"
+
+/* Tickets are handed out from 1, so a ticket is its own index into visits */
+struct Visit
+{
+    pid_t visitor;
+    uint32_t salon;
+    int status; /* -1 until the server answers */
+    int server; /* Index into servers */
+    uint32_t redirects;
+    uint32_t group; /* First ticket of its party */
+    int groupSize;  /* 0 if it came alone */
+    int together;
+};
+
+struct Salon
+{
+    int sock;
+    int kind;
+    uint32_t id;
+
+    /* Servers our visits went to: the one we opened, then any that a redirect
+       named. Once there are several the socket is no longer connected */
+    struct sockaddr_in *servers;
+    int serverCount;
+    int unbound;
+
+    struct Visit *visits; /* visits[ticket - 1] */
+    uint32_t visitCount;
+    uint32_t visitCap;
+    SalonCallback cb;
+    void *arg;
+    int64_t offset;  /* Added to our CLOCK_MONOTONIC gives the server's */
+    int64_t bestRtt; /* Of the probe offset came from, 0 if none yet */
+};
+
+struct Salon *SalonOpen(const char *ip, const char *port)
+{
+    struct Endpoint ep;
+    struct Salon *s;
+
+    if (ParseEndpoint(ip, port, &ep) < 0 || (s = calloc(1, sizeof(*s))) == NULL)
+    {
+        return NULL;
+    }
+    if ((s->sock = TransportConnect(&ep)) < 0)
+    {
+        free(s);
+        return NULL;
+    }
+    s->kind = ep.kind;
+    if (ep.kind == TRANSPORT_UDP)
+    {
+        if ((s->servers = malloc(sizeof(*s->servers))) == NULL)
+        {
+            SalonClose(s);
+            return NULL;
+        }
+        memcpy(&s->servers[0], &ep.addr, sizeof(s->servers[0]));
+        s->serverCount = 1;
+    }
+    return s;
+}
+
+void SalonOnStatus(struct Salon *s, SalonCallback cb, void *arg)
+{
+    s->cb = cb;
+    s->arg = arg;
+}
+
+void SalonSetId(struct Salon *s, uint32_t salon)
+{
+    s->id = salon;
+}
+
+int SalonFd(const struct Salon *s)
+{
+    return s->sock;
+}
+
+/* Send to servers[server] */
+static ssize_t post(struct Salon *s, int server, const void *msg, size_t len)
+{
+    if (!s->unbound)
+    {
+        return send(s->sock, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    return sendto(s->sock, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL, (const struct sockaddr *)&s->servers[server],
+                  sizeof(s->servers[server]));
+}
+
+/* Index of the server a message came from, -1 if it isn't one of ours */
+static int serverOf(const struct Salon *s, const struct sockaddr_in *from)
+{
+    for (int i = 0; i < s->serverCount; i++)
+    {
+        if (s->servers[i].sin_addr.s_addr == from->sin_addr.s_addr && s->servers[i].sin_port == from->sin_port)
+            return i;
+    }
+    return -1;
+}
+
+/* Next message from any of our servers */
+static ssize_t receive(struct Salon *s, void *buf, size_t len)
+{
+    struct sockaddr_in from;
+    socklen_t fromLen;
+    ssize_t n;
+
+    if (!s->unbound)
+    {
+        return recv(s->sock, buf, len, MSG_DONTWAIT);
+    }
+    do
+    {
+        fromLen = sizeof(from);
+        n = recvfrom(s->sock, buf, len, MSG_DONTWAIT, (struct sockaddr *)&from, &fromLen);
+    } while (n >= 0 && serverOf(s, &from) < 0);
+    return n;
+}
+
+static int request(struct Salon *s, int type, uint32_t ticket, const struct Stamp *echo)
+{
+    struct ClientRequest req;
+    struct Visit *v = &s->visits[ticket - 1];
+    memset(&req, 0, sizeof(req));
+    req.magic = REQUEST_MAGIC;
+    req.type = type;
+    req.ticket = ticket;
+    req.visitor = v->visitor;
+    req.salon = v->salon;
+    req.redirects = v->redirects;
+    if (echo != NULL)
+        req.echo = *echo;
+    /* The clock offset is only known for the server we opened */
+    StampNow(&req.sent, s->offset, s->bestRtt > 0 && v->server == 0 ? STAMP_SYNCED : 0);
+    if (post(s, v->server, &req, sizeof(req)) != sizeof(req))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* Make room for count more visits and set them up, not yet counted */
+static struct Visit *reserve(struct Salon *s, uint32_t count)
+{
+    if (s->visitCount + count > s->visitCap)
+    {
+        uint32_t cap = s->visitCap > 0 ? s->visitCap : 16;
+        while (cap < s->visitCount + count)
+            cap *= 2;
+        struct Visit *grown = realloc(s->visits, cap * sizeof(*grown));
+        if (grown == NULL)
+            return NULL;
+        s->visits = grown;
+        s->visitCap = cap;
+    }
+    struct Visit *v = &s->visits[s->visitCount];
+    memset(v, 0, count * sizeof(*v));
+    for (uint32_t i = 0; i < count; i++)
+    {
+        v[i].salon = s->id;
+        v[i].status = -1;
+    }
+    return v;
+}
+
+int SalonVisit(struct Salon *s, pid_t visitor, uint32_t *ticket)
+{
+    struct Visit *v = reserve(s, 1);
+    if (v == NULL)
+    {
+        return -1;
+    }
+    v->visitor = visitor;
+    if (request(s, REQ_VISIT, s->visitCount + 1, NULL) < 0)
+    {
+        return -1;
+    }
+    *ticket = ++s->visitCount;
+    return 0;
+}
+
+int SalonVisitGroup(struct Salon *s, const pid_t *visitors, int count, int together, uint32_t *ticket)
+{
+    struct GroupRequest g;
+    struct Visit *v;
+    uint32_t first = s->visitCount + 1;
+
+    if (count < 1 || count > MAX_GROUP)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((v = reserve(s, count)) == NULL)
+    {
+        return -1;
+    }
+    memset(&g, 0, sizeof(g));
+    for (int i = 0; i < count; i++)
+    {
+        v[i].visitor = visitors[i];
+        v[i].group = first;
+        v[i].groupSize = count;
+        v[i].together = together;
+        g.visitors[i] = visitors[i];
+    }
+    g.req.magic = REQUEST_MAGIC;
+    g.req.type = REQ_GROUP;
+    g.req.ticket = first;
+    g.req.visitor = visitors[0];
+    g.req.salon = s->id;
+    g.count = count;
+    g.flags = together ? GROUP_TOGETHER : 0;
+    StampNow(&g.req.sent, s->offset, s->bestRtt > 0 ? STAMP_SYNCED : 0);
+    if (post(s, 0, &g, sizeof(g)) != sizeof(g))
+    {
+        return -1;
+    }
+    s->visitCount += count;
+    *ticket = first;
+    return 0;
+}
+
+int SalonCancel(struct Salon *s, uint32_t ticket)
+{
+    if (ticket == 0 || ticket > s->visitCount)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    struct Visit *v = &s->visits[ticket - 1];
+    if (!v->together)
+    {
+        return request(s, REQ_CANCEL, ticket, NULL);
+    }
+    for (int i = 0; i < v->groupSize; i++)
+    {
+        if (request(s, REQ_CANCEL, v->group + i, NULL) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int SalonSync(struct Salon *s)
+{
+    struct ClockSync sync;
+    struct Stamp now;
+
+    memset(&sync, 0, sizeof(sync));
+    sync.magic = SYNC_MAGIC;
+    StampNow(&now, 0, 0);
+    sync.t1 = now.mono;
+    if (post(s, 0, &sync, sizeof(sync)) != sizeof(sync))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int SalonClockOffset(const struct Salon *s, int64_t *offset)
+{
+    if (s->bestRtt == 0)
+    {
+        return -1;
+    }
+    *offset = s->offset;
+    return 0;
+}
+
+static void synced(struct Salon *s, const struct ClockSync *sync, const struct Stamp *now)
+{
+    int64_t rtt;
+    int64_t offset = SyncOffset(sync, now->mono, &rtt);
+    if (rtt <= 0)
+        rtt = 1;
+    if (s->bestRtt == 0 || rtt < s->bestRtt)
+    {
+        s->bestRtt = rtt;
+        s->offset = offset;
+    }
+}
+
+/* Ask the server the redirect names instead. The application doesn't notice */
+/* The server sent the visit elsewhere and it can't follow: turned away */
+static int unfollowed(struct Salon *s, uint32_t ticket)
+{
+    s->visits[ticket - 1].status = VISIT_REJECTED;
+    if (s->cb != NULL)
+        s->cb(s, ticket, VISIT_REJECTED, s->arg);
+    return 1;
+}
+
+/* Changes of status it made, 1 if the visit could not follow */
+static int redirected(struct Salon *s, const struct ClientRedirect *rd)
+{
+    struct Visit *v = &s->visits[rd->ticket - 1];
+    struct sockaddr_in to;
+    int i;
+
+    if (s->kind != TRANSPORT_UDP || v->status != -1 || v->redirects > 0)
+    {
+        return 0;
+    }
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_addr.s_addr = rd->addr;
+    to.sin_port = rd->port;
+    if ((i = serverOf(s, &to)) < 0)
+    {
+        struct sockaddr_in *grown = realloc(s->servers, (s->serverCount + 1) * sizeof(*grown));
+        if (grown == NULL)
+            return unfollowed(s, rd->ticket);
+        s->servers = grown;
+        s->servers[i = s->serverCount++] = to;
+    }
+    if (!s->unbound)
+    {
+        /* Dissolve the association, so that every server can answer. That
+           frees the port connect() picked, so bind it back at once: the
+           servers we already talk to send there */
+        struct sockaddr none = {.sa_family = AF_UNSPEC};
+        struct sockaddr_in local;
+        socklen_t localLen = sizeof(local);
+        if (getsockname(s->sock, (struct sockaddr *)&local, &localLen) < 0 ||
+            connect(s->sock, &none, sizeof(none)) < 0)
+            return unfollowed(s, rd->ticket);
+        if (bind(s->sock, (struct sockaddr *)&local, localLen) < 0)
+        {
+            /* Somebody took the port: back to the first server alone, on whatever port we get now */
+            connect(s->sock, (struct sockaddr *)&s->servers[0], sizeof(s->servers[0]));
+            return unfollowed(s, rd->ticket);
+        }
+        s->unbound = 1;
+    }
+    v->server = i;
+    v->redirects++;
+    request(s, REQ_VISIT, rd->ticket, NULL);
+    return 0;
+}
+
+int SalonStatus(const struct Salon *s, uint32_t ticket)
+{
+    if (ticket == 0 || ticket > s->visitCount)
+    {
+        return -1;
+    }
+    return s->visits[ticket - 1].status;
+}
+
+int SalonProcess(struct Salon *s)
+{
+    union
+    {
+        struct ClientStatus st;
+        struct ClockSync sync;
+        struct ClientRedirect rd;
+    } msg;
+    struct ClientStatus st;
+    struct Stamp now;
+    ssize_t n;
+    int changes = 0;
+
+    while ((n = receive(s, &msg, sizeof(msg))) > 0)
+    {
+        StampNow(&now, s->offset, s->bestRtt > 0 ? STAMP_SYNCED : 0);
+        if (n == sizeof(msg.sync) && msg.sync.magic == SYNC_MAGIC)
+        {
+            synced(s, &msg.sync, &now);
+            continue;
+        }
+        if (n == sizeof(msg.rd) && msg.rd.magic == REDIRECT_MAGIC)
+        {
+            if (msg.rd.ticket > 0 && msg.rd.ticket <= s->visitCount)
+                changes += redirected(s, &msg.rd);
+            continue;
+        }
+        st = msg.st;
+        if (n != sizeof(st) || st.magic != REQUEST_MAGIC || st.ticket == 0 || st.ticket > s->visitCount)
+        {
+            continue;
+        }
+        struct Visit *v = &s->visits[st.ticket - 1];
+        uint32_t last = st.ticket;
+        if (v->status == (int)st.status)
+        {
+            continue;
+        }
+        if (v->groupSize > 0 && v->group == st.ticket && (v->together || st.status == VISIT_LIMITED))
+        {
+            /* News of the party as one, or it was turned away before the server looked inside */
+            last = v->group + v->groupSize - 1;
+        }
+        for (uint32_t t = st.ticket; t <= last; t++)
+        {
+            s->visits[t - 1].status = st.status;
+        }
+        if (st.status == VISIT_DONE || st.status == VISIT_REJECTED || st.status == VISIT_CANCELLED ||
+            st.status == VISIT_LIMITED)
+        {
+            /* Lets the server time the last leg of the visit */
+            request(s, REQ_RECEIPT, st.ticket, &st.sent);
+        }
+        for (uint32_t t = st.ticket; t <= (v->together ? st.ticket : last); t++)
+        {
+            changes++;
+            if (s->cb != NULL)
+                s->cb(s, t, st.status, s->arg);
+        }
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    {
+        return -1;
+    }
+    return changes;
+}
+
+void SalonClose(struct Salon *s)
+{
+    close(s->sock);
+    free(s->servers);
+    free(s->visits);
+    free(s);
+}
@@ -0,0 +1,62 @@
+#ifndef LIBSALON_H
+#define LIBSALON_H
+
+#include <stdint.h>    /* for uint32_t and int64_t */
+#include <sys/types.h> /* for pid_t */
+
+#include "salon.h" /* for enum VisitStatus */
+
+/* Client side of the salon for programs with their own event loop.
+   Any number of visits share one socket and are told apart by ticket.
+   Nothing here blocks: wait for SalonFd() to become readable, then call
+   SalonProcess(). A visit redirected to another server of a cluster is
+   followed on the same socket, and only its status changes are reported.
+   One that can't be followed is VISIT_REJECTED */
+struct Salon;
+
+/* Called by SalonProcess() for every status change */
+typedef void (*SalonCallback)(struct Salon *s, uint32_t ticket, int status, void *arg);
+
+/* port may be "unix:/path". NULL if the salon can't be reached */
+struct Salon *SalonOpen(const char *ip, const char *port);
+
+void SalonOnStatus(struct Salon *s, SalonCallback cb, void *arg);
+
+/* Which of the salons the server hosts to visit, 0 unless set. Visits already asked for stay where they are */
+void SalonSetId(struct Salon *s, uint32_t salon);
+
+/* Descriptor which becomes readable when there is news for SalonProcess() */
+int SalonFd(const struct Salon *s);
+
+/* Ask for a haircut for visitor. Returns 0 and the ticket, or -1 with errno
+   (EAGAIN if the socket is busy, try again when it is writable) */
+int SalonVisit(struct Salon *s, pid_t visitor, uint32_t *ticket);
+
+/* Ask for haircuts for a party of count visitors (at most MAX_GROUP), queued
+   one behind the other or not at all. Member i gets ticket *ticket + i and is
+   reported on its own, or if together, the party is reported once by *ticket:
+   queued, and then over when its last member is. Returns 0 or -1 with errno */
+int SalonVisitGroup(struct Salon *s, const pid_t *visitors, int count, int together, uint32_t *ticket);
+
+/* Give up waiting. Only works while in the queue, the status becomes VISIT_CANCELLED.
+   A party that is reported as one gives up as one */
+int SalonCancel(struct Salon *s, uint32_t ticket);
+
+/* Probe the server's clock. SalonProcess() takes the reply, and of several
+   probes keeps the one with the shortest round trip. Visits sent after that
+   let the server measure their one-way latency by CLOCK_MONOTONIC */
+int SalonSync(struct Salon *s);
+
+/* What to add to our CLOCK_MONOTONIC to get the server's. -1 if no probe came back yet */
+int SalonClockOffset(const struct Salon *s, int64_t *offset);
+
+/* Last status heard for the ticket, -1 if nothing yet or unknown ticket */
+int SalonStatus(const struct Salon *s, uint32_t ticket);
+
+/* Read all news that has arrived. Returns the number of status changes,
+   or -1 if the connection is lost */
+int SalonProcess(struct Salon *s);
+
+void SalonClose(struct Salon *s);
+
+#endif
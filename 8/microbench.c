@@ -0,0 +1,524 @@
+#define _GNU_SOURCE /* for sendmmsg() and F_SETPIPE_SZ */
+#include <stdio.h>       /* for printf() */
+#include <stdlib.h>      /* for malloc() and exit() */
+#include <string.h>      /* for memcpy() and memset() */
+#include <unistd.h>      /* for pipe(), read(), write() and syscall() */
+#include <fcntl.h>       /* for fcntl() */
+#include <time.h>        /* for clock_gettime() */
+#include <stdatomic.h>
+#include <sys/ioctl.h>   /* for ioctl() */
+#include <sys/syscall.h> /* for SYS_perf_event_open */
+#include <linux/perf_event.h>
+#include <sys/socket.h>  /* for socket(), sendto() and sendmmsg() */
+#include <arpa/inet.h>   /* for sockaddr_in */
+
+#include "transport.h"
+#include "salon.h"
+
+/* What the pieces of the server's hot paths cost on their own, each next to
+   the alternative it could be replaced with. Every case is run until a
+   repetition takes REP_NS, then WARMUP_REPS times untimed and REPS times
+   timed; the median and the median absolute deviation of the repetitions
+   are printed per operation, with CPU cycles from perf_event_open() where
+   the kernel allows it. Built with the server's flags, so that the numbers
+   are those of the shipped code */
+#define WARMUP_REPS 3
+#define REPS 15
+#define REP_NS 20000000 /* 20 ms */
+
+/* Runs the case iters times; ops is how many operations each iteration is */
+typedef void (*BenchFn)(void *arg, long iters);
+
+int cyclesFd = -1;
+const char *cyclesScope = "unavailable";
+volatile long sink; /* Results go here, so that nothing is optimized away */
+
+long NowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Cycles of this thread, kernel included if allowed */
+void OpenCycles()
+{
+    struct perf_event_attr attr;
+
+    for (int user = 0; user < 2 && cyclesFd < 0; user++)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        attr.disabled = 1;
+        attr.exclude_kernel = user;
+        attr.exclude_hv = 1;
+        cyclesFd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        cyclesScope = user ? "user only" : "user and kernel";
+    }
+    if (cyclesFd < 0)
+    {
+        cyclesScope = "unavailable";
+    }
+}
+
+int CompareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+double Median(double *v, int n)
+{
+    qsort(v, n, sizeof(double), CompareDoubles);
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+/* Median absolute deviation */
+double Mad(const double *v, int n, double median)
+{
+    double dev[REPS];
+    for (int i = 0; i < n; i++)
+    {
+        dev[i] = v[i] > median ? v[i] - median : median - v[i];
+    }
+    return Median(dev, n);
+}
+
+void Run(const char *name, BenchFn fn, void *arg, long ops)
+{
+    double ns[REPS];
+    double cycles[REPS];
+    long iters = 1;
+    long long count;
+
+    /* Long enough for the clock */
+    for (;;)
+    {
+        long start = NowNs();
+        fn(arg, iters);
+        if (NowNs() - start >= REP_NS || iters >= 1L << 40)
+            break;
+        iters *= 2;
+    }
+    for (int r = 0; r < WARMUP_REPS; r++)
+    {
+        fn(arg, iters);
+    }
+    for (int r = 0; r < REPS; r++)
+    {
+        if (cyclesFd >= 0)
+        {
+            ioctl(cyclesFd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(cyclesFd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        long start = NowNs();
+        fn(arg, iters);
+        ns[r] = (double)(NowNs() - start) / (iters * ops);
+        if (cyclesFd >= 0)
+        {
+            ioctl(cyclesFd, PERF_EVENT_IOC_DISABLE, 0);
+            cycles[r] = read(cyclesFd, &count, sizeof(count)) == sizeof(count) ? (double)count / (iters * ops) : 0;
+        }
+    }
+    double median = Median(ns, REPS);
+    printf("%-40s %10.1f ns/op  MAD %7.1f", name, median, Mad(ns, REPS, median));
+    if (cyclesFd >= 0)
+        printf("  %10.1f cycles/op", Median(cycles, REPS));
+    printf("\n");
+    fflush(stdout);
+}
+
+/* Events as the writer gets them: every type, different visitors */
+#define EVENTS 256
+
+struct SalonEvent events[EVENTS];
+
+void MakeEvents()
+{
+    for (int i = 0; i < EVENTS; i++)
+    {
+        events[i].seq = i + 1;
+        events[i].timeMs = i * 7;
+        events[i].type = i % EV_TYPES;
+        events[i].pid = 10000 + i * 13;
+        events[i].hairdresser = i % 4;
+        events[i].salon = 0;
+    }
+}
+
+/* FanOut() for a text observer: one line per event */
+void FormatText(void *arg, long iters)
+{
+    char str[150];
+    long len = 0;
+    (void)arg;
+    for (long i = 0; i < iters; i++)
+    {
+        len += FormatEvent(&events[i % EVENTS], str);
+    }
+    sink = len;
+}
+
+/* FanOut() and FlushBatch() for a binary observer: copied into the group,
+   then into the datagram when the batch is full */
+void EncodeBinary(void *arg, long iters)
+{
+    struct SalonEvent pending[BATCH_EVENTS];
+    char buffer[BATCH_BYTES];
+    struct EventBatch *batch = (struct EventBatch *)buffer;
+    int count = 0;
+    long len = 0;
+    (void)arg;
+    for (long i = 0; i < iters; i++)
+    {
+        pending[count++] = events[i % EVENTS];
+        if (count == BATCH_EVENTS)
+        {
+            batch->magic = BATCH_MAGIC;
+            batch->count = count;
+            batch->first = pending[0].seq;
+            batch->last = pending[count - 1].seq;
+            memcpy(batch->events, pending, count * sizeof(struct SalonEvent));
+            len += sizeof(*batch) + count * sizeof(struct SalonEvent);
+            count = 0;
+        }
+    }
+    sink = len;
+}
+
+/* Shards to the writer: a round of reports in one write(), as FlushReports()
+   does, and the writer's read(). Per event */
+#define ROUND_EVENTS (4096 / sizeof(struct SalonEvent))
+
+void PipeRoundTrip(void *arg, long iters)
+{
+    int *fds = arg;
+    struct SalonEvent round[ROUND_EVENTS];
+    for (long i = 0; i < iters; i++)
+    {
+        memcpy(round, events, sizeof(round));
+        if (write(fds[1], round, sizeof(round)) != sizeof(round) || read(fds[0], round, sizeof(round)) != sizeof(round))
+        {
+            perror("Info pipe");
+            exit(1);
+        }
+    }
+    sink = round[0].seq;
+}
+
+/* The same through a single-producer single-consumer ring in memory */
+#define QUEUE_EVENTS 4096
+
+struct EventQueue
+{
+    atomic_ulong head; /* Next to read */
+    atomic_ulong tail; /* Next to write */
+    struct SalonEvent events[QUEUE_EVENTS];
+};
+
+int QueuePush(struct EventQueue *q, const struct SalonEvent *evs, int n)
+{
+    unsigned long tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    if (tail + n - atomic_load_explicit(&q->head, memory_order_acquire) > QUEUE_EVENTS)
+        return 0;
+    /* At most two pieces: up to the end of the ring and from its start */
+    int at = tail % QUEUE_EVENTS;
+    int piece = n < QUEUE_EVENTS - at ? n : QUEUE_EVENTS - at;
+    memcpy(&q->events[at], evs, piece * sizeof(struct SalonEvent));
+    memcpy(q->events, evs + piece, (n - piece) * sizeof(struct SalonEvent));
+    atomic_store_explicit(&q->tail, tail + n, memory_order_release);
+    return n;
+}
+
+int QueuePop(struct EventQueue *q, struct SalonEvent *evs, int n)
+{
+    unsigned long head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    unsigned long ready = atomic_load_explicit(&q->tail, memory_order_acquire) - head;
+    if ((unsigned long)n > ready)
+        n = ready;
+    int at = head % QUEUE_EVENTS;
+    int piece = n < QUEUE_EVENTS - at ? n : QUEUE_EVENTS - at;
+    memcpy(evs, &q->events[at], piece * sizeof(struct SalonEvent));
+    memcpy(evs + piece, q->events, (n - piece) * sizeof(struct SalonEvent));
+    atomic_store_explicit(&q->head, head + n, memory_order_release);
+    return n;
+}
+
+void QueueRoundTrip(void *arg, long iters)
+{
+    struct EventQueue *q = arg;
+    struct SalonEvent round[ROUND_EVENTS];
+    for (long i = 0; i < iters; i++)
+    {
+        memcpy(round, events, sizeof(round));
+        if (QueuePush(q, round, ROUND_EVENTS) != ROUND_EVENTS || QueuePop(q, round, ROUND_EVENTS) != ROUND_EVENTS)
+        {
+            fprintf(stderr, "Event queue lost events\n");
+            exit(1);
+        }
+    }
+    sink = round[0].seq;
+}
+
+/* One batch of one event to each of n observers. They are n addresses over
+   a few bound sockets, which drop what they have no room for: the sender
+   pays the same either way */
+#define RECEIVERS 16
+#define MMSG_CHUNK 1024 /* UIO_MAXIOV */
+
+struct Fanout
+{
+    int sock;
+    int n;
+    struct sockaddr_in *to;
+    struct mmsghdr *msgs;
+    struct iovec iov;
+    char datagram[sizeof(struct EventBatch) + sizeof(struct SalonEvent)];
+};
+
+void SendEach(void *arg, long iters)
+{
+    struct Fanout *f = arg;
+    for (long i = 0; i < iters; i++)
+    {
+        for (int o = 0; o < f->n; o++)
+        {
+            sendto(f->sock, f->datagram, sizeof(f->datagram), 0, (struct sockaddr *)&f->to[o], sizeof(f->to[o]));
+        }
+    }
+}
+
+void SendBatched(void *arg, long iters)
+{
+    struct Fanout *f = arg;
+    for (long i = 0; i < iters; i++)
+    {
+        for (int o = 0; o < f->n; o += MMSG_CHUNK)
+        {
+            int n = f->n - o < MMSG_CHUNK ? f->n - o : MMSG_CHUNK;
+            sendmmsg(f->sock, f->msgs + o, n, 0);
+        }
+    }
+}
+
+/* Finding the observer a message came from: HandleWritable() and
+   AnswerNacks() scan the table with PeerEqual(), against a hash of the address */
+struct Lookup
+{
+    int n;
+    struct Peer *peers;
+    int *slots; /* Open addressing: 1 + index into peers, 0 if empty */
+    int slotCount;
+    int *probes; /* Who to look up, in a fixed random order */
+};
+
+#define PROBES 4096
+
+uint32_t PeerHash(const struct Peer *p)
+{
+    const unsigned char *b = (const unsigned char *)&p->addr;
+    uint32_t h = 2166136261u;
+    for (socklen_t i = 0; i < p->addrLen; i++)
+    {
+        h = (h ^ b[i]) * 16777619u;
+    }
+    return h;
+}
+
+void ScanTable(void *arg, long iters)
+{
+    struct Lookup *l = arg;
+    long found = 0;
+    for (long i = 0; i < iters; i++)
+    {
+        const struct Peer *p = &l->peers[l->probes[i % PROBES]];
+        for (int o = 0; o < l->n; o++)
+        {
+            if (PeerEqual(&l->peers[o], p))
+            {
+                found += o;
+                break;
+            }
+        }
+    }
+    sink = found;
+}
+
+void HashTable(void *arg, long iters)
+{
+    struct Lookup *l = arg;
+    long found = 0;
+    for (long i = 0; i < iters; i++)
+    {
+        const struct Peer *p = &l->peers[l->probes[i % PROBES]];
+        for (int s = PeerHash(p) & (l->slotCount - 1); l->slots[s] != 0; s = (s + 1) & (l->slotCount - 1))
+        {
+            if (PeerEqual(&l->peers[l->slots[s] - 1], p))
+            {
+                found += l->slots[s] - 1;
+                break;
+            }
+        }
+    }
+    sink = found;
+}
+
+void BenchFormat()
+{
+    printf("\nEvent encoding, per event\n");
+    Run("sprintf text (FormatEvent)", FormatText, NULL, 1);
+    Run("binary batch (EventBatch)", EncodeBinary, NULL, 1);
+}
+
+void BenchHandOver()
+{
+    int fds[2];
+    struct EventQueue *q = calloc(1, sizeof(*q));
+
+    if (pipe(fds) < 0 || q == NULL)
+    {
+        perror("Can't set up the info pipe");
+        exit(1);
+    }
+    fcntl(fds[1], F_SETPIPE_SZ, 1 << 20);
+    printf("\nShards to the writer, per event in rounds of %d\n", (int)ROUND_EVENTS);
+    Run("info_pipe write() + read()", PipeRoundTrip, fds, ROUND_EVENTS);
+    Run("in-memory SPSC queue", QueueRoundTrip, q, ROUND_EVENTS);
+    close(fds[0]);
+    close(fds[1]);
+    free(q);
+}
+
+void BenchFanout()
+{
+    const int counts[] = {1, 10, 100, 1000, 10000};
+    struct sockaddr_in recv[RECEIVERS];
+    int receivers[RECEIVERS];
+    socklen_t len = sizeof(struct sockaddr_in);
+    struct Fanout f;
+    char name[64];
+
+    memset(&f, 0, sizeof(f));
+    for (int r = 0; r < RECEIVERS; r++)
+    {
+        memset(&recv[r], 0, sizeof(recv[r]));
+        recv[r].sin_family = AF_INET;
+        recv[r].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if ((receivers[r] = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0 ||
+            bind(receivers[r], (struct sockaddr *)&recv[r], sizeof(recv[r])) < 0 ||
+            getsockname(receivers[r], (struct sockaddr *)&recv[r], &len) < 0)
+        {
+            perror("Can't bind an observer socket");
+            exit(1);
+        }
+    }
+    if ((f.sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+    {
+        perror("socket() failed");
+        exit(1);
+    }
+    struct EventBatch *batch = (struct EventBatch *)f.datagram;
+    batch->magic = BATCH_MAGIC;
+    batch->count = 1;
+    batch->first = batch->last = events[0].seq;
+    batch->events[0] = events[0];
+    f.iov.iov_base = f.datagram;
+    f.iov.iov_len = sizeof(f.datagram);
+
+    printf("\nFan-out of one batch, per observer\n");
+    for (int c = 0; c < (int)(sizeof(counts) / sizeof(counts[0])); c++)
+    {
+        f.n = counts[c];
+        f.to = malloc(f.n * sizeof(*f.to));
+        f.msgs = calloc(f.n, sizeof(*f.msgs));
+        if (f.to == NULL || f.msgs == NULL)
+        {
+            perror("malloc() failed");
+            exit(1);
+        }
+        for (int o = 0; o < f.n; o++)
+        {
+            f.to[o] = recv[o % RECEIVERS];
+            f.msgs[o].msg_hdr.msg_name = &f.to[o];
+            f.msgs[o].msg_hdr.msg_namelen = sizeof(f.to[o]);
+            f.msgs[o].msg_hdr.msg_iov = &f.iov;
+            f.msgs[o].msg_hdr.msg_iovlen = 1;
+        }
+        snprintf(name, sizeof(name), "sendto(), %d observers", f.n);
+        Run(name, SendEach, &f, f.n);
+        snprintf(name, sizeof(name), "sendmmsg(), %d observers", f.n);
+        Run(name, SendBatched, &f, f.n);
+        free(f.to);
+        free(f.msgs);
+    }
+    close(f.sock);
+    for (int r = 0; r < RECEIVERS; r++)
+    {
+        close(receivers[r]);
+    }
+}
+
+void BenchLookup()
+{
+    const int counts[] = {1, 15, 100, 1000, 10000}; /* 15 is MAX_OBSERVERS */
+    struct Lookup l;
+    char name[64];
+
+    printf("\nFinding an observer by address, per lookup\n");
+    srand(1);
+    for (int c = 0; c < (int)(sizeof(counts) / sizeof(counts[0])); c++)
+    {
+        l.n = counts[c];
+        for (l.slotCount = 1; l.slotCount < 2 * l.n; l.slotCount *= 2)
+            ;
+        l.peers = calloc(l.n, sizeof(*l.peers));
+        l.slots = calloc(l.slotCount, sizeof(*l.slots));
+        l.probes = malloc(PROBES * sizeof(*l.probes));
+        if (l.peers == NULL || l.slots == NULL || l.probes == NULL)
+        {
+            perror("malloc() failed");
+            exit(1);
+        }
+        for (int o = 0; o < l.n; o++)
+        {
+            /* UDP observers, all on one host as in a test */
+            struct sockaddr_in *in = (struct sockaddr_in *)&l.peers[o].addr;
+            in->sin_family = AF_INET;
+            in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            in->sin_port = htons(20000 + o);
+            l.peers[o].addrLen = sizeof(*in);
+            l.peers[o].fd = -1;
+            int s = PeerHash(&l.peers[o]) & (l.slotCount - 1);
+            while (l.slots[s] != 0)
+                s = (s + 1) & (l.slotCount - 1);
+            l.slots[s] = o + 1;
+        }
+        for (int i = 0; i < PROBES; i++)
+        {
+            l.probes[i] = rand() % l.n;
+        }
+        snprintf(name, sizeof(name), "table scan, %d observers", l.n);
+        Run(name, ScanTable, &l, 1);
+        snprintf(name, sizeof(name), "hashed lookup, %d observers", l.n);
+        Run(name, HashTable, &l, 1);
+        free(l.peers);
+        free(l.slots);
+        free(l.probes);
+    }
+}
+
+int main(void)
+{
+    MakeEvents();
+    OpenCycles();
+    printf("Median of %d repetitions of at least %d ms after %d warmups, cycles %s\n", REPS, REP_NS / 1000000,
+           WARMUP_REPS, cyclesScope);
+    BenchFormat();
+    BenchHandOver();
+    BenchFanout();
+    BenchLookup();
+    return 0;
+}
@@ -5,6 +5,12 @@
 #include <string.h>     /* for memset() */
 #include <unistd.h>     /* for close() */
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+
+#include "transport.h"
+#include "salon.h"
+#include "stats.h"
 
 int sock; /* Socket descriptor */
 
@@ -27,52 +33,564 @@ void sigfunc(int sig)
     exit(0);
 }
 
+const char *eventNames[EV_TYPES] = {"open", "queued", "dispatched", "served", "left", "lost", "abandoned", "closed"};
+
+/* "queued,left" -> EV_BIT(EV_QUEUED) | EV_BIT(EV_LEFT) */
+uint32_t ParseEvents(char *list)
+{
+    uint32_t mask = 0;
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ","))
+    {
+        int type;
+        for (type = 0; type < EV_TYPES && strcmp(name, eventNames[type]) != 0; type++)
+            ;
+        if (type == EV_TYPES)
+        {
+            fprintf(stderr, "Unknown event %s\n", name);
+            exit(-1);
+        }
+        mask |= EV_BIT(type);
+    }
+    return mask;
+}
+
+/* "0,2" -> hairdressers 0 and 2 */
+uint64_t ParseHairdressers(char *list)
+{
+    uint64_t mask = 0;
+    for (char *id = strtok(list, ","); id != NULL; id = strtok(NULL, ","))
+    {
+        int i = atoi(id);
+        if (i < 0 || i >= MAX_HAIRDRESSERS)
+        {
+            fprintf(stderr, "Hairdresser id must be below %d\n", MAX_HAIRDRESSERS);
+            exit(-1);
+        }
+        mask |= (uint64_t)1 << i;
+    }
+    return mask;
+}
+
+void PrintSnapshot(const struct SalonSnapshot *snap)
+{
+    if (snap->first == 0)
+    {
+        printf("Salon after event %u: %u came, %u got a haircut, %u gave up, %u waiting\n", snap->seq,
+               snap->counts[EV_QUEUED], snap->counts[EV_SERVED], snap->counts[EV_ABANDONED], snap->queueLen);
+        for (int h = 0; h < MAX_HAIRDRESSERS; h++)
+        {
+            if (snap->chairs[h] > 0)
+                printf("Hairdresser %d is cutting client %d\n", h, snap->chairs[h]);
+            else if (snap->chairs[h] == 0)
+                printf("Hairdresser %d is sleeping\n", h);
+        }
+    }
+    for (uint32_t i = 0; i < snap->count; i++)
+    {
+        printf("Client %d has been in the queue for %.1f s\n",
+               snap->waiting[i].pid, snap->waiting[i].waitedMs / 1000.0);
+    }
+}
+
+/* Dashboard mode: events are folded into running aggregates in constant memory
+   and the screen is redrawn a few times per second */
+#define WAIT_SLOTS 65536  /* Visitors tracked between arrival and haircut */
+#define RATE_SECONDS 60   /* Longest window for arrival and haircut rates */
+#define FRAME_BYTES 8192
+
+struct Rate
+{
+    uint32_t second[RATE_SECONDS]; /* Which server second the bucket counts */
+    uint32_t count[RATE_SECONDS];
+};
+
+struct Chair
+{
+    int present;
+    pid_t pid;       /* 0 if sleeping */
+    uint32_t since;  /* Start of the current haircut */
+    uint64_t busyMs; /* Finished haircuts since we started watching */
+};
+
+struct WaitSlot
+{
+    pid_t pid; /* 0 if free */
+    uint32_t queuedMs;
+};
+
+int dashboard = 0;
+int frameMs = 500;
+long offsetMs;         /* Server clock minus ours */
+uint32_t watchStartMs; /* Server time when we started watching */
+uint32_t lastSeq;
+int queueDepth;
+long arrivals;
+long haircuts;
+long abandoned;
+struct Rate arrivalRate;
+struct Rate haircutRate;
+struct Chair chairs[MAX_CHAIRS]; /* Snapshots only have the first MAX_HAIRDRESSERS */
+struct WaitSlot waits[WAIT_SLOTS];
+struct P2Quantile waitQ[3];
+struct P2Quantile serviceQ[3];
+const double quantiles[3] = {0.5, 0.9, 0.99};
+
+long LocalMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint32_t ServerNowMs()
+{
+    return LocalMs() + offsetMs;
+}
+
+void CountRate(struct Rate *r, uint32_t ms)
+{
+    uint32_t sec = ms / 1000;
+    int i = sec % RATE_SECONDS;
+    if (r->second[i] != sec)
+    {
+        r->second[i] = sec;
+        r->count[i] = 0;
+    }
+    r->count[i]++;
+}
+
+/* Events per second during the last `seconds` complete seconds */
+double RateOver(const struct Rate *r, int seconds)
+{
+    uint32_t now = ServerNowMs() / 1000;
+    uint32_t sum = 0;
+    for (int i = 0; i < RATE_SECONDS; i++)
+    {
+        if (r->second[i] < now && r->second[i] + seconds >= now)
+            sum += r->count[i];
+    }
+    return (double)sum / seconds;
+}
+
+/* Open addressing with linear probing and backward shift deletion */
+int WaitSlotOf(pid_t pid)
+{
+    int i = ((uint32_t)pid * 2654435761u) % WAIT_SLOTS;
+    while (waits[i].pid != 0 && waits[i].pid != pid)
+        i = (i + 1) % WAIT_SLOTS;
+    return i;
+}
+
+void RememberArrival(pid_t pid, uint32_t ms)
+{
+    int i = WaitSlotOf(pid);
+    if (waits[i].pid == 0 && arrivals - haircuts - abandoned >= WAIT_SLOTS - 1)
+        return; /* Table is full, this visitor's wait is not measured */
+    waits[i].pid = pid;
+    waits[i].queuedMs = ms;
+}
+
+int ForgetArrival(pid_t pid, uint32_t *queuedMs)
+{
+    int i = WaitSlotOf(pid);
+    if (waits[i].pid == 0)
+        return 0;
+    *queuedMs = waits[i].queuedMs;
+    waits[i].pid = 0;
+    for (int j = (i + 1) % WAIT_SLOTS; waits[j].pid != 0; j = (j + 1) % WAIT_SLOTS)
+    {
+        int home = ((uint32_t)waits[j].pid * 2654435761u) % WAIT_SLOTS;
+        /* Move j into the hole if the hole lies between home and j */
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j))
+        {
+            waits[i] = waits[j];
+            waits[j].pid = 0;
+            i = j;
+        }
+    }
+    return 1;
+}
+
+void FoldSnapshot(const struct SalonSnapshot *snap)
+{
+    offsetMs = (long)snap->timeMs - LocalMs();
+    lastSeq = snap->seq;
+    if (snap->first == 0)
+    {
+        watchStartMs = snap->timeMs;
+        queueDepth = snap->queueLen;
+        arrivals = snap->counts[EV_QUEUED];
+        haircuts = snap->counts[EV_SERVED];
+        abandoned = snap->counts[EV_ABANDONED];
+        for (int h = 0; h < MAX_HAIRDRESSERS; h++)
+        {
+            chairs[h].present = snap->chairs[h] >= 0;
+            chairs[h].pid = snap->chairs[h] > 0 ? snap->chairs[h] : 0;
+            chairs[h].since = snap->timeMs;
+        }
+    }
+    for (uint32_t i = 0; i < snap->count; i++)
+    {
+        RememberArrival(snap->waiting[i].pid, snap->timeMs - snap->waiting[i].waitedMs);
+    }
+}
+
+void Fold(const struct SalonEvent *ev)
+{
+    struct Chair *c;
+    uint32_t queuedMs;
+
+    /* From the network: check it before it indexes anything */
+    if (ev->seq <= lastSeq || ev->hairdresser < 0 || ev->hairdresser >= MAX_CHAIRS)
+        return;
+    c = &chairs[ev->hairdresser];
+    lastSeq = ev->seq;
+    if ((long)ev->timeMs - LocalMs() > offsetMs)
+        offsetMs = (long)ev->timeMs - LocalMs();
+
+    switch (ev->type)
+    {
+    case EV_OPEN:
+        c->present = 1;
+        c->pid = 0;
+        break;
+    case EV_QUEUED:
+        queueDepth++;
+        arrivals++;
+        CountRate(&arrivalRate, ev->timeMs);
+        RememberArrival(ev->pid, ev->timeMs);
+        break;
+    case EV_DISPATCHED:
+        queueDepth--;
+        c->pid = ev->pid;
+        c->since = ev->timeMs;
+        if (ForgetArrival(ev->pid, &queuedMs))
+        {
+            for (int q = 0; q < 3; q++)
+                P2Add(&waitQ[q], (ev->timeMs - queuedMs) / 1000.0);
+        }
+        break;
+    case EV_SERVED:
+        haircuts++;
+        CountRate(&haircutRate, ev->timeMs);
+        if (c->pid != 0)
+        {
+            for (int q = 0; q < 3; q++)
+                P2Add(&serviceQ[q], (ev->timeMs - c->since) / 1000.0);
+            c->busyMs += ev->timeMs - (c->since > watchStartMs ? c->since : watchStartMs);
+        }
+        c->pid = 0;
+        break;
+    case EV_LEFT:
+        /* Still tracked only if it left without a haircut */
+        if (ForgetArrival(ev->pid, &queuedMs))
+            queueDepth--;
+        break;
+    case EV_ABANDONED:
+        abandoned++;
+        if (ForgetArrival(ev->pid, &queuedMs))
+            queueDepth--;
+        break;
+    case EV_LOST:
+        if (c->pid != 0)
+        {
+            c->busyMs += ev->timeMs - (c->since > watchStartMs ? c->since : watchStartMs);
+            queueDepth++;
+            RememberArrival(ev->pid, ev->timeMs);
+        }
+        c->present = 0;
+        c->pid = 0;
+        break;
+    case EV_CLOSED:
+        c->present = 0;
+        c->pid = 0;
+        break;
+    }
+}
+
+/* Gap recovery: a batch that does not start right after what we have seen
+   is held back and the missing events are asked for again, until they come
+   or the server tells us to start over from a new snapshot */
+#define HELD_BATCHES 32
+#define NACK_RETRY_MS 200
+
+struct HeldBatch
+{
+    int len;
+    char data[BATCH_BYTES];
+};
+
+uint32_t covered; /* Every event up to this one has been seen, or is in the snapshot */
+uint32_t missing; /* Last event asked for again, 0 if none */
+long nackedMs;
+struct HeldBatch held[HELD_BATCHES];
+int heldCount;
+
+void SendNack(uint32_t first, uint32_t last)
+{
+    struct ObserverNack nack = {NACK_MAGIC, first, last};
+    send(sock, &nack, sizeof(nack), 0);
+    nackedMs = LocalMs();
+}
+
+/* Events of the batch that we have not seen yet, in order */
+void Deliver(const struct EventBatch *batch, int len)
+{
+    char str[150];
+
+    for (uint32_t i = 0; i < batch->count && sizeof(*batch) + (i + 1) * sizeof(struct SalonEvent) <= (size_t)len; i++)
+    {
+        if (batch->events[i].seq <= covered)
+            continue;
+        if (dashboard)
+        {
+            Fold(&batch->events[i]);
+            continue;
+        }
+        FormatEvent(&batch->events[i], str);
+        fputs(str, stdout);
+    }
+    if (batch->last > covered)
+        covered = batch->last;
+}
+
+/* Deliver held batches that no longer follow a gap */
+void Unhold()
+{
+    int i = 0;
+    while (i < heldCount)
+    {
+        struct EventBatch *batch = (struct EventBatch *)held[i].data;
+        if (batch->first > covered + 1)
+        {
+            i++;
+            continue;
+        }
+        Deliver(batch, held[i].len);
+        held[i] = held[--heldCount];
+        i = 0;
+    }
+    if (heldCount == 0 && covered >= missing)
+        missing = 0;
+}
+
+void ReceiveBatch(const struct EventBatch *batch, int len)
+{
+    if (batch->first <= covered + 1)
+    {
+        Deliver(batch, len);
+        Unhold();
+        return;
+    }
+    if (heldCount == HELD_BATCHES)
+    {
+        /* Too far behind: ask for everything, this batch included */
+        heldCount = 0;
+        missing = batch->last;
+        SendNack(covered + 1, missing);
+        return;
+    }
+    held[heldCount].len = len;
+    memcpy(held[heldCount].data, batch, len);
+    heldCount++;
+    if (batch->first - 1 > missing)
+    {
+        missing = batch->first - 1;
+        SendNack(covered + 1, missing);
+    }
+}
+
+/* The events we asked for did not come, ask again */
+void RetryNack()
+{
+    if (missing > covered && LocalMs() - nackedMs >= NACK_RETRY_MS)
+        SendNack(covered + 1, missing);
+}
+
+/* The server no longer has what we missed. Its snapshot comes next */
+void Resync()
+{
+    heldCount = 0;
+    missing = 0;
+    if (dashboard)
+    {
+        memset(waits, 0, sizeof(waits));
+        return;
+    }
+    printf("Missed too many events, starting over\n");
+}
+
+/* Build the whole frame first, so that the terminal gets one write() */
+void Redraw()
+{
+    char frame[FRAME_BYTES];
+    int len = 0;
+    uint32_t now = ServerNowMs();
+    uint32_t watched = now > watchStartMs ? now - watchStartMs : 1;
+
+#define OUT(...) len += snprintf(frame + len, len < FRAME_BYTES ? FRAME_BYTES - len : 0, __VA_ARGS__)
+    OUT("\033[H\033[J");
+    OUT("Salon at %.1f s, event %u\n\n", now / 1000.0, lastSeq);
+    OUT("Queue:        %d waiting\n", queueDepth);
+    OUT("Came:         %ld  (%.2f/s 1s, %.2f/s 10s, %.2f/s 60s)\n", arrivals,
+        RateOver(&arrivalRate, 1), RateOver(&arrivalRate, 10), RateOver(&arrivalRate, 60));
+    OUT("Got haircut:  %ld  (%.2f/s 1s, %.2f/s 10s, %.2f/s 60s)\n", haircuts,
+        RateOver(&haircutRate, 1), RateOver(&haircutRate, 10), RateOver(&haircutRate, 60));
+    OUT("Gave up:      %ld  (%.1f%% of arrivals)\n", abandoned, arrivals > 0 ? 100.0 * abandoned / arrivals : 0.0);
+    OUT("Wait, s:      p50 %.2f  p90 %.2f  p99 %.2f\n", P2Value(&waitQ[0]), P2Value(&waitQ[1]), P2Value(&waitQ[2]));
+    OUT("Haircut, s:   p50 %.2f  p90 %.2f  p99 %.2f\n\n", P2Value(&serviceQ[0]), P2Value(&serviceQ[1]), P2Value(&serviceQ[2]));
+    for (int h = 0; h < MAX_CHAIRS; h++)
+    {
+        struct Chair *c = &chairs[h];
+        if (!c->present)
+            continue;
+        uint64_t busy = c->busyMs;
+        if (c->pid != 0)
+            busy += now - (c->since > watchStartMs ? c->since : watchStartMs);
+        if (c->pid != 0)
+            OUT("Hairdresser %-3d %5.1f%% busy, cutting client %d\n", h, 100.0 * busy / watched, c->pid);
+        else
+            OUT("Hairdresser %-3d %5.1f%% busy, sleeping\n", h, 100.0 * busy / watched);
+    }
+#undef OUT
+    if (len > FRAME_BYTES)
+        len = FRAME_BYTES;
+    write(STDOUT_FILENO, frame, len);
+}
+
 int main(int argc, char *argv[])
 {
     signal(SIGINT, sigfunc);
     signal(SIGTERM, sigfunc);
 
-    struct sockaddr_in servAddr; /* Echo server address */
-    unsigned short servPort;     /* Echo server port */
-    char *servIP;                /* Server IP address  */
-    char buffer[150];
+    struct Endpoint servEp; /* Server address */
+    char buffer[BATCH_BYTES + 1];
+    struct EventBatch *batch = (struct EventBatch *)buffer;
+    struct SalonSnapshot *snap = (struct SalonSnapshot *)buffer;
+    struct ObserverResync *resync = (struct ObserverResync *)buffer;
     int bytesRcvd; /* Bytes read in single recv() */
 
-    if (argc != 3) /* Test for correct number of arguments */
+    struct ObserverFilter filter; /* What the server should send us */
+    int opt;
+
+    memset(&filter, 0, sizeof(filter));
+    while ((opt = getopt(argc, argv, "e:d:s:Dr:i:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            filter.salon = strtoul(optarg, NULL, 10);
+            break;
+        case 'e':
+            filter.events = ParseEvents(optarg);
+            break;
+        case 'd':
+            filter.hairdressers = ParseHairdressers(optarg);
+            break;
+        case 's':
+            filter.sampling = atof(optarg) * SAMPLE_SCALE / 100;
+            break;
+        case 'D':
+            dashboard = 1;
+            break;
+        case 'r':
+            if ((frameMs = 1000 / atof(optarg)) <= 0)
+                argc = 0;
+            break;
+        default:
+            argc = 0;
+        }
+    }
+
+    if (argc - optind != 2) /* Test for correct number of arguments */
     {
-        fprintf(stderr, "Usage: %s <Server IP> <Echo Port>\n",
+        fprintf(stderr, "Usage: %s [-e <event,...>] [-d <hairdresser id,...>] [-s <sampled %% of visitors>] [-D [-r <redraws per second>]] [-i <salon id>] <Server IP> <Server Port | unix:<path>>\n",
                 argv[0]);
+        fprintf(stderr, "Events: open, queued, dispatched, served, left, lost, abandoned, closed\n");
         exit(-1);
     }
 
-    servIP = argv[1];         /* First arg: server IP address (dotted quad) */
-    servPort = atoi(argv[2]); /* port */
+    /* Second arg may be unix:<path> instead of a port */
+    if (ParseEndpoint(argv[optind], argv[optind + 1], &servEp) < 0)
+        DieWithError("Invalid address");
 
-    /* Create a reliable, stream socket using TCP */
-    if ((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
-        DieWithError("socket() failed");
+    /* Create a socket connected to the server */
+    if ((sock = TransportConnect(&servEp)) < 0)
+        DieWithError("connect() failed");
 
-    /* Construct the server address structure */
-    memset(&servAddr, 0, sizeof(servAddr));       /* Zero out structure */
-    servAddr.sin_family = AF_INET;                /* Internet address family */
-    servAddr.sin_addr.s_addr = inet_addr(servIP); /* Server IP address */
-    servAddr.sin_port = htons(servPort);          /* Server port */
+    /* Numbered events, even to print them: only those show a gap to ask for again */
+    filter.events |= FILTER_BINARY;
+    if (dashboard)
+    {
+        for (int q = 0; q < 3; q++)
+        {
+            P2Init(&waitQ[q], quantiles[q]);
+            P2Init(&serviceQ[q], quantiles[q]);
+        }
+    }
 
-    /* Establish the connection to the server */
-    if (connect(sock, (struct sockaddr *)&servAddr, sizeof(servAddr)) < 0)
-        DieWithError("connect() failed");
-    int h = 0;
-    if (sendto(sock, &h, sizeof(int), 0, (struct sockaddr *)&servAddr, sizeof(servAddr)) != sizeof(int))
+    if (send(sock, &filter, sizeof(filter), 0) != sizeof(filter))
     {
         DieWithError("sendto() sent to the hairdresser a different number of bytes than expected");
     }
     // printf("Observer is ready\n");
 
+    struct pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    long nextFrame = LocalMs();
+
     for (;;)
     {
-        if ((bytesRcvd = recv(sock, &buffer, 149, 0)) <= 0)
+        long wait = -1;
+        if (dashboard)
+        {
+            wait = nextFrame - LocalMs();
+            if (wait <= 0)
+            {
+                Redraw();
+                nextFrame += frameMs;
+                continue;
+            }
+        }
+        if (missing > covered && (wait < 0 || wait > NACK_RETRY_MS))
+            wait = NACK_RETRY_MS;
+        if (poll(&pfd, 1, wait) <= 0)
+        {
+            RetryNack();
+            continue;
+        }
+
+        if ((bytesRcvd = recv(sock, &buffer, BATCH_BYTES, 0)) <= 0)
             DieWithError("recv() failed or connection closed prematurely");
 
+        if (bytesRcvd >= (int)sizeof(*snap) && snap->magic == SNAPSHOT_MAGIC)
+        {
+            /* State of the salon at the moment we registered, or resynced */
+            if (snap->first == 0)
+                covered = snap->seq;
+            if (dashboard)
+                FoldSnapshot(snap);
+            else
+                PrintSnapshot(snap);
+            continue;
+        }
+
+        if (bytesRcvd >= (int)sizeof(*batch) && batch->magic == BATCH_MAGIC)
+        {
+            /* Coalesced events */
+            ReceiveBatch(batch, bytesRcvd);
+            RetryNack();
+            continue;
+        }
+
+        if (bytesRcvd == sizeof(*resync) && resync->magic == RESYNC_MAGIC)
+        {
+            Resync();
+            continue;
+        }
+
+        /* A server too old to send batches */
         buffer[bytesRcvd] = '\0';
         printf("%s", buffer);
     }
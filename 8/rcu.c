@@ -0,0 +1,81 @@
+#include <stdlib.h>    /* for malloc() and free() */
+#include <stdatomic.h> /* for atomic_ulong */
+
+#include "rcu.h"
+
+struct Retired
+{
+    void (*fn)(void *);
+    void *p;
+    unsigned long epoch; /* Freed when every reader has seen this epoch */
+    struct Retired *next;
+};
+
+static atomic_ulong globalEpoch = 1;
+static atomic_ulong readerEpochs[RCU_MAX_READERS]; /* 0 if the slot is free */
+static atomic_int readers;
+static struct Retired *retired;
+
+int RcuRegisterReader(void)
+{
+    int reader = atomic_fetch_add(&readers, 1);
+    if (reader >= RCU_MAX_READERS)
+    {
+        return -1;
+    }
+    atomic_store(&readerEpochs[reader], atomic_load(&globalEpoch));
+    return reader;
+}
+
+void RcuQuiescent(int reader)
+{
+    atomic_store(&readerEpochs[reader], atomic_load(&globalEpoch));
+}
+
+void RcuRetire(void *p)
+{
+    RcuCall(free, p);
+}
+
+void RcuCall(void (*fn)(void *), void *p)
+{
+    struct Retired *r = malloc(sizeof(*r));
+    if (r == NULL)
+    {
+        /* Leaking is safe, freeing too early is not */
+        return;
+    }
+    r->fn = fn;
+    r->p = p;
+    r->epoch = atomic_fetch_add(&globalEpoch, 1) + 1;
+    r->next = retired;
+    retired = r;
+}
+
+void RcuReclaim(void)
+{
+    unsigned long safe = atomic_load(&globalEpoch);
+    int n = atomic_load(&readers);
+    for (int i = 0; i < n && i < RCU_MAX_READERS; i++)
+    {
+        unsigned long e = atomic_load(&readerEpochs[i]);
+        if (e != 0 && e < safe)
+            safe = e;
+    }
+
+    struct Retired **link = &retired;
+    while (*link != NULL)
+    {
+        struct Retired *r = *link;
+        if (r->epoch <= safe)
+        {
+            *link = r->next;
+            r->fn(r->p);
+            free(r);
+        }
+        else
+        {
+            link = &r->next;
+        }
+    }
+}
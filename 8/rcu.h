@@ -0,0 +1,26 @@
+#ifndef RCU_H
+#define RCU_H
+
+/* Quiescent-state based reclamation for read-mostly data published through
+   an atomic pointer. Readers never lock: they call RcuQuiescent() whenever
+   they hold no references to published data. Updaters are serialized by
+   the caller, publish a new version and RcuRetire() the old one, which is
+   freed once every reader has passed a quiescent state */
+
+#define RCU_MAX_READERS 16
+
+/* Returns the reader's slot, -1 if there are too many readers */
+int RcuRegisterReader(void);
+
+void RcuQuiescent(int reader);
+
+/* p is freed with free() once no reader can see it. Updaters only */
+void RcuRetire(void *p);
+
+/* Same, but fn(p) is called instead of free(p) */
+void RcuCall(void (*fn)(void *), void *p);
+
+/* Free what is safe to free. Updaters only */
+void RcuReclaim(void);
+
+#endif
@@ -0,0 +1,61 @@
+#include <stdio.h> /* for sprintf() */
+#include <time.h>  /* for clock_gettime() */
+
+#include "salon.h"
+
+int FormatEvent(const struct SalonEvent *ev, char *str)
+{
+    switch (ev->type)
+    {
+    case EV_OPEN:
+        return sprintf(str, "Hairdresser's is open\n");
+    case EV_QUEUED:
+        return sprintf(str, "Client %d is in the queue\n", ev->pid);
+    case EV_DISPATCHED:
+        return sprintf(str, "Client %d leaves the queue for a haircut\n", ev->pid);
+    case EV_SERVED:
+        return sprintf(str, "Client %d got a haircut\nHaidresser is sleeping\n", ev->pid);
+    case EV_LEFT:
+        return sprintf(str, "Client %d left\n", ev->pid);
+    case EV_LOST:
+        if (ev->pid != 0)
+            return sprintf(str, "Hairdresser is gone\nClient %d is back in the queue\n", ev->pid);
+        return sprintf(str, "Hairdresser is gone\n");
+    case EV_ABANDONED:
+        return sprintf(str, "Client %d gave up waiting\n", ev->pid);
+    case EV_CLOSED:
+        return sprintf(str, "Hairdresser went home\n");
+    }
+    return 0;
+}
+
+void StampNow(struct Stamp *s, int64_t offset, uint32_t flags)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    s->mono = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    s->real = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    s->offset = offset;
+    s->flags = flags;
+    s->pad = 0;
+}
+
+int64_t HopNs(const struct Stamp *from, const struct Stamp *to)
+{
+    if (from->real == 0 || to->real == 0)
+    {
+        return 0;
+    }
+    if ((from->flags & STAMP_SYNCED) && (to->flags & STAMP_SYNCED))
+    {
+        return (to->mono + to->offset) - (from->mono + from->offset);
+    }
+    return to->real - from->real;
+}
+
+int64_t SyncOffset(const struct ClockSync *s, int64_t t4, int64_t *rtt)
+{
+    *rtt = (t4 - s->t1) - (s->t3 - s->t2);
+    return ((s->t2 - s->t1) + (s->t3 - t4)) / 2;
+}
@@ -0,0 +1,302 @@
+#ifndef SALON_H
+#define SALON_H
+
+#include <stdint.h>    /* for uint32_t and uint64_t */
+#include <sys/types.h> /* for pid_t */
+
+/* What happened in the salon, as reported to observers */
+enum EventType
+{
+    EV_OPEN,       /* Hairdresser's is open */
+    EV_QUEUED,     /* Client is in the queue */
+    EV_DISPATCHED, /* Client leaves the queue for a haircut */
+    EV_SERVED,     /* Client got a haircut */
+    EV_LEFT,       /* Client left */
+    EV_LOST,       /* Hairdresser is gone, its client (if any) is back at the front of the queue */
+    EV_ABANDONED,  /* Client gave up waiting: cancelled or gone */
+    EV_CLOSED,     /* Free chair closed: its hairdresser went home */
+    EV_TYPES
+};
+
+#define EV_BIT(type) (1u << (type))
+#define EV_ALL (EV_BIT(EV_TYPES) - 1)
+
+/* When one end of a hop sent or received a message, ns. offset turns mono
+   into the server's CLOCK_MONOTONIC and is only known with STAMP_SYNCED
+   (the server's own stamps always have it). Hops between stamps that both
+   have it are measured by CLOCK_MONOTONIC, others by CLOCK_REALTIME */
+#define STAMP_SYNCED 1
+
+struct Stamp
+{
+    int64_t mono;
+    int64_t real;
+    int64_t offset;
+    uint32_t flags;
+    uint32_t pad;
+};
+
+void StampNow(struct Stamp *s, int64_t offset, uint32_t flags);
+
+/* How long from from to to, ns. 0 if either end is missing */
+int64_t HopNs(const struct Stamp *from, const struct Stamp *to);
+
+/* NTP-style estimate of the server's clock against ours. Sent by a client
+   or hairdresser with t1 set, returned by the server with t2 and t3 set.
+   All are CLOCK_MONOTONIC of the one who set them */
+#define SYNC_MAGIC 0x434e5953 /* "SYNC" */
+#define SYNC_PROBES 4         /* The one with the shortest round trip wins */
+
+struct ClockSync
+{
+    uint32_t magic;
+    uint32_t pad;
+    int64_t t1; /* Peer sent */
+    int64_t t2; /* Server received */
+    int64_t t3; /* Server replied */
+};
+
+/* Offset to add to our CLOCK_MONOTONIC to get the server's, from a reply received at t4.
+   The round trip it was measured over goes to *rtt */
+int64_t SyncOffset(const struct ClockSync *s, int64_t t4, int64_t *rtt);
+
+/* One server hosts many salons, each with its own queue, hairdressers and
+   observers. Every message that starts something names its salon; old
+   clients, hairdressers and observers, which don't, go to salon 0 */
+#define MAX_SALONS 1024 /* In one server */
+
+/* Client to server. A bare pid, as sent by old clients, is a visit with
+   ticket == pid, and such a client only hears back once it is done */
+#define REQUEST_MAGIC 0x524e4c53 /* "SLNR" */
+
+enum RequestType
+{
+    REQ_VISIT,
+    REQ_CANCEL, /* Only while still in the queue */
+    REQ_RECEIPT, /* The visit is over: sent is when the client heard, echo is ClientStatus.sent */
+    REQ_GROUP    /* Only in a GroupRequest */
+};
+
+struct ClientRequest
+{
+    uint32_t magic;
+    uint32_t type;
+    uint32_t ticket; /* Chosen by the client, unique among its visits */
+    pid_t visitor;   /* Reported to observers */
+    uint32_t salon;
+    uint32_t redirects; /* Times the visit was sent to another server. Only fresh ones are */
+    struct Stamp sent;
+    struct Stamp echo;
+};
+
+/* Client to server: a party that comes together, in one datagram. Its
+   members join the queue one behind the other, or the whole party is turned
+   away if the queue has no room for all of them. Member i has ticket
+   req.ticket + i and hears about its own visit, or with GROUP_TOGETHER the
+   party hears as one, by req.ticket: queued once, and over once its last
+   member is, with that member's status. Parties are never redirected */
+#define MAX_GROUP 16
+#define GROUP_TOGETHER 1
+
+struct GroupRequest
+{
+    struct ClientRequest req; /* type REQ_GROUP, visitor is visitors[0] */
+    uint32_t count;
+    uint32_t flags;
+    pid_t visitors[MAX_GROUP];
+};
+
+/* Server to client, on every change of a visit */
+enum VisitStatus
+{
+    VISIT_QUEUED,
+    VISIT_IN_CHAIR,
+    VISIT_DONE,
+    VISIT_REJECTED, /* The queue is full, or the client could not follow a redirect */
+    VISIT_CANCELLED,
+    VISIT_LIMITED /* Too many visits from the client's host lately, try again later */
+};
+
+struct ClientStatus
+{
+    uint32_t magic; /* REQUEST_MAGIC */
+    uint32_t ticket;
+    uint32_t status;
+    struct Stamp sent;
+};
+
+/* Server to client instead of VISIT_QUEUED: another server of the cluster
+   expects a shorter wait. The client asks it again with redirects set.
+   IPv4 UDP only, in network byte order */
+#define REDIRECT_MAGIC 0x444e4c53 /* "SLND" */
+
+struct ClientRedirect
+{
+    uint32_t magic;
+    uint32_t ticket;
+    uint32_t addr;
+    uint16_t port;
+    uint16_t pad;
+};
+
+/* Hairdresser to server: its chairs, to register and as the heartbeat while
+   all of them are free, or no chairs as the heartbeat while cutting.
+   A bare int (its id) registers one chair of salon 0 */
+#define REGISTER_MAGIC 0x434e4c53 /* "SLNC" */
+#define MAX_CHAIRS 1024           /* In the whole salon */
+
+struct Register
+{
+    uint32_t magic;
+    uint32_t chairs;
+    uint32_t salon;
+    pid_t pid; /* Lets a server that started the hairdresser tell which it is */
+};
+
+/* Server to hairdresser: the client to cut */
+struct Job
+{
+    pid_t visitor;
+    uint32_t chair; /* Of this hairdresser, from 0 */
+    struct Stamp sent;
+};
+
+/* Hairdresser to server when done. A bare pid does too, without the stamps */
+struct JobDone
+{
+    pid_t visitor;
+    uint32_t chair;
+    uint32_t salon;
+    uint32_t pad;
+    struct Stamp echo;     /* Job.sent */
+    struct Stamp received; /* When the job came */
+    struct Stamp sent;
+};
+
+/* Every HEARTBEAT_MS a hairdresser repeats its registration while all its
+   chairs are free and sends one without chairs while cutting. Old ones send HEARTBEAT */
+#define HEARTBEAT (-1)
+#define HEARTBEAT_MS 1000
+#define HEARTBEAT_MISSES 3 /* Silent for this many periods means dead */
+
+/* How long a haircut takes. The server gives a chair twice as long,
+   or twice its -s if that is longer, before it gives up on the hairdresser */
+#define HAIRCUT_MS 3000
+
+#define MAX_HAIRDRESSERS 64 /* Chairs in ObserverFilter.hairdressers and SalonSnapshot.chairs */
+#define SAMPLE_SCALE 10000  /* ObserverFilter.sampling is in 1/10000 of visitors */
+
+struct SalonEvent
+{
+    uint32_t seq;    /* Number of the event in its salon since the server started */
+    uint32_t timeMs; /* When it happened, ms since the server started */
+    int type;
+    pid_t pid;       /* 0 if the event is not about a client */
+    int hairdresser; /* Chair, below MAX_CHAIRS */
+    uint32_t salon;  /* Where it happened */
+};
+
+/* With coalescing on, observers get several events per datagram */
+#define BATCH_MAGIC 0x424e4c53 /* "SLNB", can't be the start of a text message */
+#define BATCH_BYTES 1472       /* Ethernet MTU minus IP and UDP headers */
+
+/* Batches of one observer cover consecutive ranges of its salon's events,
+   so a gap between two of them means datagrams were lost */
+struct EventBatch
+{
+    uint32_t magic;
+    uint32_t count;
+    uint32_t first; /* Every event from first to last that the filter matches is here */
+    uint32_t last;
+    struct SalonEvent events[];
+};
+
+#define BATCH_EVENTS ((BATCH_BYTES - sizeof(struct EventBatch)) / sizeof(struct SalonEvent))
+
+/* Sent to an observer when it registers, before any event after seq.
+   Long queues are split into several datagrams with the same seq */
+#define SNAPSHOT_MAGIC 0x534e4c53 /* "SLNS" */
+
+struct WaitingVisitor
+{
+    pid_t pid;
+    uint32_t waitedMs; /* Time in the queue so far */
+};
+
+struct SalonSnapshot
+{
+    uint32_t magic;
+    uint32_t seq;                   /* Last event reflected in the snapshot */
+    uint32_t timeMs;                /* When it was taken, ms since the server started */
+    uint32_t counts[EV_TYPES];      /* Events of each type so far */
+    pid_t chairs[MAX_HAIRDRESSERS]; /* Client in each of the first chairs, 0 if free, -1 if absent */
+    uint32_t queueLen;              /* Visitors waiting */
+    uint32_t first;                 /* Position of waiting[0] in the queue */
+    uint32_t count;
+    struct WaitingVisitor waiting[];
+};
+
+#define SNAPSHOT_VISITORS ((BATCH_BYTES - sizeof(struct SalonSnapshot)) / sizeof(struct WaitingVisitor))
+
+/* Writes the human readable form of ev to str, returns its length */
+int FormatEvent(const struct SalonEvent *ev, char *str);
+
+/* Sent by an observer to register. Zero fields mean "everything".
+   A bare int, as sent by old observers, is the same as an empty filter */
+#define FILTER_BINARY (1u << 31) /* In ObserverFilter.events: always send EventBatch datagrams */
+
+struct ObserverFilter
+{
+    uint32_t events;       /* EV_BIT() mask, maybe with FILTER_BINARY */
+    uint32_t sampling;     /* Visitors to report, out of SAMPLE_SCALE */
+    uint64_t hairdressers; /* Bit i selects chair i, the last bit also every chair above */
+    uint32_t salon;        /* The one salon to watch */
+    uint32_t pad;
+};
+
+/* Sent by an observer that missed events first .. last. The server sends
+   them again from its history, or RESYNC and a new snapshot once they are
+   no longer kept */
+#define NACK_MAGIC 0x4b4e4c53   /* "SLNK" */
+#define RESYNC_MAGIC 0x594e4c53 /* "SLNY" */
+
+struct ObserverNack
+{
+    uint32_t magic;
+    uint32_t first;
+    uint32_t last;
+};
+
+struct ObserverResync
+{
+    uint32_t magic;
+    uint32_t oldest; /* First event the server still keeps */
+};
+
+/* Between the servers of a cluster, every GOSSIP_MS: how long a newcomer
+   would wait in each salon, and where its clients go. addr 0 means the
+   address the gossip came from, port 0 that it takes no redirected clients */
+#define GOSSIP_MAGIC 0x474e4c53 /* "SLNG" */
+#define GOSSIP_MS 500
+
+struct GossipSalon
+{
+    uint32_t salon;
+    uint32_t queueLen;
+    uint32_t chairs; /* Of live hairdressers */
+    int32_t waitMs;  /* -1 if nobody cuts */
+};
+
+struct Gossip
+{
+    uint32_t magic;
+    uint32_t count;
+    uint32_t addr;
+    uint16_t port;
+    uint16_t pad;
+    struct GossipSalon salons[];
+};
+
+#define GOSSIP_SALONS ((BATCH_BYTES - sizeof(struct Gossip)) / sizeof(struct GossipSalon)) /* The first ones */
+
+#endif
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE /* for F_SETPIPE_SZ */
+
 #include <stdio.h>      /* for printf() and fprintf() */
 #include <sys/socket.h> /* for socket(), bind(), and connect() */
 #include <arpa/inet.h>  /* for sockaddr_in and inet_ntoa() */
@@ -7,244 +9,4492 @@
 #include <signal.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <sys/un.h>   /* for sockaddr_un */
+#include <limits.h> /* for PATH_MAX */
+#include <math.h>   /* for sqrt() */
+
+#include "transport.h"
+#include "salon.h"
+#include "rcu.h"
+#include "uring.h"
+#include "trace.h"
+#include "stats.h"
+
+pthread_mutex_t tableLock; /* Serializes updates of the observer table, readers don't take it */
+
+struct Transport servClnt;
+struct Transport servHrdr;
+struct Transport servObsrv;
+
+struct Visitor
+{
+    pid_t pid; /* Client's id */
+    uint32_t ticket;
+    int legacy;   /* Sent a bare pid and only expects it back when done */
+    int detached; /* Hung up, nobody to tell */
+    int64_t arrived; /* CLOCK_MONOTONIC, ns */
+    struct Peer peer;
+    uint32_t group;      /* First ticket of its party */
+    int together;        /* The party hears as one, by ticket group */
+    struct Party *party; /* If together: shared by its members */
+};
+
+/* Members of a party that hears as one and are not done yet */
+struct Party
+{
+    int left;
+};
+
+/* Where the time of a visit goes, printed on shutdown */
+enum Hop
+{
+    HOP_CLIENT_SERVER,
+    HOP_QUEUE, /* Arrival to dispatch */
+    HOP_SERVER_HRDR,
+    HOP_HAIRCUT,
+    HOP_HRDR_SERVER,
+    HOP_SERVER_CLIENT, /* The final status */
+    HOPS
+};
+
+const char *hopNames[HOPS] = {"client->server", "queue", "server->hrdr", "haircut", "hrdr->server", "server->client"};
 
-pthread_mutex_t mutex; /* For correct info messaging */
+int maxWaiting = 0; /* Visitors turned away beyond this, 0 if unlimited */
 
-int servClntSock;
-int servHrdrSock;
-int servObsrvSock;
-struct sockaddr_in hrdrAddr; /* Hairdresser address */
+int serviceMs = 3000; /* Expected haircut time */
 
 int info_pipe[2];
 
+struct timespec startTime; /* Event times are counted from here */
+
+int coalesceMs = 0; /* Coalescing window for observer events, 0 if off */
+
+#define DROP_OLDEST 0
+#define DROP_NEWEST 1
+#define DROP_DISCONNECT 2
+
+int dropPolicy = DROP_OLDEST; /* What to do when an observer's queue is full */
+int outCap = 64;              /* Messages per observer queue */
+int writerEpoll;              /* Info pipe and observer sockets we wait to write to */
+int writerWake;               /* eventfd: the observer table has changed */
+atomic_ulong lostEvents;      /* Events the writer never saw because the pipe was full */
+int historyLen = 1024;        /* Events kept per salon for observers that missed some */
+
+/* Observers that asked for events again, passed from AcceptObserver() to the writer */
+#define MAX_NACKS 64
+
+struct PendingNack
+{
+    struct Peer peer;
+    uint32_t first;
+    uint32_t last;
+};
+
+pthread_mutex_t nackLock;
+struct PendingNack nacks[MAX_NACKS];
+int nackCount;
+
+/* Zero-downtime restart: a new server connects to handoffPath and takes over
+   the sockets, the queue and the observers of this one */
+struct Transport servHandoff;
+char *handoffPath;
+atomic_int handoffRequested; /* The writer must flush everything and park */
+sem_t writerParked;
+pthread_t acceptThread;
+int acceptStop; /* eventfd: AcceptObserver() must return */
+int shutdownWake; /* eventfd: SIGINT or SIGTERM came, the main thread closes the day */
+
+/* Cluster mode: servers started with -g and -p gossip how long a newcomer
+   would wait in each of their salons, and each sends a new visitor to the
+   peer with the shortest wait when it is clearly shorter than its own.
+   Nobody coordinates: every server goes by what it heard last */
+#define MAX_PEER_SERVERS 16
+#define GOSSIP_STALE_MS (3 * GOSSIP_MS) /* Older news is ignored */
+
+struct PeerServer
+{
+    struct Peer gossip;         /* Where it listens for gossip */
+    struct sockaddr_in clients; /* Where its clients go, port 0 if nowhere yet */
+    struct timespec heard;
+    int count;
+    struct GossipSalon salons[GOSSIP_SALONS];
+};
+
+struct Transport servGossip;
+int gossipOn;
+struct PeerServer peerServers[MAX_PEER_SERVERS];
+int peerServerCount;
+pthread_mutex_t peersLock; /* The gossip thread updates peerServers, shards pick from them */
+pthread_t gossipThread;
+
+/* Autoscaling (-a): the server starts hairdressers of its own for every
+   salon and retires them again, to keep the expected wait near the target
+   with as few as it takes. Starts when the wait is over the target, retires
+   an idle one of its own after the wait has stayed under half of it for
+   SCALE_COOLDOWN_MS, and stays within the bounds, counting the others too */
+#define SCALE_MS 1000
+#define SCALE_COOLDOWN_MS 10000
+
+struct Spawned
+{
+    pid_t pid;
+    int registered; /* Has shown up since it was started */
+    int retiring;   /* Told to go home, not reaped yet */
+};
+
+int scaleMin = -1; /* Hairdressers per salon, -1 if autoscaling is off */
+int scaleMax;
+int targetWaitMs; /* 0 for the expected haircut time */
+char hairdresserPath[PATH_MAX];
+char hairdresserIP[INET_ADDRSTRLEN];
+char hairdresserPort[128];
+
+/* Compiled ObserverFilter. Observers with equal predicates share a group,
+   so every event is matched once per group rather than once per observer */
+struct Predicate
+{
+    uint32_t events;
+    uint32_t sampling;
+    uint64_t hairdressers;
+    uint32_t salon;
+    uint32_t pad; /* So that memcmp() can tell predicates apart */
+};
+
+#define MAX_OBSERVERS 15
+
+struct FilterGroup
+{
+    struct Predicate pred;
+
+    /* Owned by the writer thread. Events waiting to be sent when coalescing is on */
+    struct timespec first; /* When events[0] was added */
+    int pending;
+    int started;      /* covered is set */
+    uint32_t covered; /* Batches sent so far cover every event up to this one */
+    struct SalonEvent events[BATCH_EVENTS];
+};
+
+/* Message waiting for the observer's socket to become writable */
+struct OutMsg
+{
+    int len;
+    char data[BATCH_BYTES];
+};
+
 struct Observer
 {
-    struct sockaddr_in addr;
-    int is_active;
+    struct Peer peer;
+    int id; /* Only for messages */
+    struct FilterGroup *group;
+
+    /* Owned by the writer thread */
+    int introduced; /* Got its snapshot */
+    int gone;       /* Dropped, waiting to be removed from the table */
+
+    /* Bounded outbound queue, so that a slow observer never blocks anybody */
+    struct OutMsg *out;
+    int outHead;
+    int outLen;
+    unsigned long dropped; /* Messages lost to the drop policy */
+};
+
+/* Immutable once published. Registration builds a new version and swaps it in,
+   the writer fans out without locks, old versions are reclaimed by rcu.c.
+   Members of groups[g] are obs[first[g]] .. obs[first[g] + members[g] - 1] */
+struct ObserverTable
+{
+    int count;
+    struct Observer *obs[MAX_OBSERVERS];
+    int groupCount;
+    struct FilterGroup *groups[MAX_OBSERVERS];
+    int first[MAX_OBSERVERS];
+    int members[MAX_OBSERVERS];
+};
+
+_Atomic(struct ObserverTable *) observerTable;
+int nextObserverId;
+
+/* Each salon as observers see it, folded from the event stream by the writer.
+   Only the writer thread touches them */
+struct Waiting
+{
+    pid_t pid;
+    struct timespec arrived;
+    int64_t order;          /* Grows toward the back of the queue */
+    struct Waiting *prev;   /* Toward the front of the queue */
+    struct Waiting *next;
+    struct Waiting *chain;  /* Same pid hash, or free nodes */
+};
+
+struct SalonState
+{
+    uint32_t salon;
+    uint32_t seq; /* Last event applied */
+    uint32_t counts[EV_TYPES];
+    pid_t chairs[MAX_HAIRDRESSERS];
+    struct Waiting *head; /* Oldest first */
+    struct Waiting *tail;
+    int waitingLen;
+    struct Waiting **buckets; /* By pid, a power of 2 of them */
+    int bucketCount;
+    struct Waiting *spare;
+    struct SalonEvent *history; /* The last historyLen events, event seq at seq % historyLen */
+    uint32_t historyFrom;       /* Events before this one were never kept */
 };
 
-struct Observer observers[15];
+struct SalonState *states[2 * MAX_SALONS]; /* By salon id, open addressing */
+int stateCount;
 
 void DieWithError(char *errorMessage)
 {
-    close(servClntSock);
-    close(servHrdrSock);
-    close(servObsrvSock);
-    pthread_mutex_destroy(&mutex);
+    TransportClose(&servClnt);
+    TransportClose(&servHrdr);
+    TransportClose(&servObsrv);
+    pthread_mutex_destroy(&tableLock);
     close(info_pipe[0]);
     close(info_pipe[1]);
     perror(errorMessage);
     exit(0);
 }
 
-int createSocket(int port, in_addr_t servInAddr)
+void createSocket(struct Transport *t, char *servIP, char *port)
 {
-    int servSock;
-    struct sockaddr_in servAddr;
-
-    /* Create socket for incoming connections */
-    if ((servSock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
-        DieWithError("socket() failed");
+    struct Endpoint ep;
 
     /* Construct local address structure */
-    memset(&servAddr, 0, sizeof(servAddr)); /* Zero out structure */
-    servAddr.sin_family = AF_INET;          /* Internet address family */
-    servAddr.sin_addr.s_addr = servInAddr;  /* Any incoming interface */
-    servAddr.sin_port = htons(port);        /* Local port */
+    if (ParseEndpoint(servIP, port, &ep) < 0)
+        DieWithError("Invalid address");
 
-    /* Bind to the local address */
-    if (bind(servSock, (struct sockaddr *)&servAddr, sizeof(servAddr)) < 0)
+    /* Create socket for incoming connections and bind to the local address */
+    if (TransportListen(t, &ep) < 0)
         DieWithError("bind() failed");
+}
 
-    return servSock;
+long ElapsedMs(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
 }
 
-void HandleUDPClient()
+/* Timers of the threads that run salons: a hierarchical timing wheel (Varghese and Lauck)
+   with O(1) start and stop. Level 0 has one slot per tick, each level above
+   one slot per whole turn of the level below. A timer sits in the lowest
+   level whose span covers it and moves down as the wheel turns.
+   Each thread sleeps on a timerfd of its own until the next tick that has work */
+#define TICK_MS 10
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 /* 64^4 ticks, a bit over 10 days; later timers wait at the top */
+
+struct Timer
+{
+    struct Timer *next;
+    struct Timer **pprev; /* NULL when not pending */
+    uint64_t expires;     /* Tick */
+    void (*fn)(struct Timer *t);
+};
+
+/* One per thread that runs salons */
+struct Wheel
 {
-    unsigned int clntLen;            /* Length of client address data structure */
-    struct sockaddr_in echoClntAddr; /* Client address */
-    /* Set the size of the in-out parameter */
-    clntLen = sizeof(echoClntAddr);
+    struct Timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t used[WHEEL_LEVELS]; /* Bit i: slots[level][i] is not empty */
+    uint64_t now;                /* Every tick up to this one has been run */
+    uint64_t armed;              /* Tick fd is set for, 0 if none */
+    struct timespec start;
+    int fd; /* timerfd */
 
-    pid_t pid;       /* Client's id */
-    int recvMsgSize; /* Size of received message */
-    char str[150];
-    if ((recvMsgSize = recvfrom(servClntSock, &pid, sizeof(int), 0, (struct sockaddr *)&echoClntAddr, &clntLen)) < 0)
+    /* Reported on shutdown */
+    long pending;
+    unsigned long fired;
+    unsigned long lagTotalMs;
+    long lagMaxMs;
+};
+
+__thread struct Wheel *wheel; /* The calling thread's, NULL if it runs no salons */
+
+uint64_t NowTick()
+{
+    return ElapsedMs(&wheel->start) / TICK_MS;
+}
+
+static void wheelInsert(struct Timer *t)
+{
+    int level = 0;
+    uint64_t delta = t->expires - wheel->now;
+
+    while (level < WHEEL_LEVELS - 1 && delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1)))
     {
-        DieWithError("recvfrom() from client failed");
+        level++;
     }
-    printf("Handling %s\n", inet_ntoa(echoClntAddr.sin_addr));
-
-    sprintf(str, "Client %d is in the queue\n", pid);
-    write(info_pipe[1], str, strlen(str));
+    uint64_t at = t->expires;
+    if (level == WHEEL_LEVELS - 1 && delta >= (uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+    {
+        /* Beyond the top: wait in its last slot and get placed again from there */
+        at = wheel->now + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+    int slot = (at >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    t->next = wheel->slots[level][slot];
+    if (t->next != NULL)
+        t->next->pprev = &t->next;
+    t->pprev = &wheel->slots[level][slot];
+    wheel->slots[level][slot] = t;
+    wheel->used[level] |= (uint64_t)1 << slot;
+}
 
-    /* Send client to hairdresser */
-    if (sendto(servHrdrSock, &pid, sizeof(int), 0, (struct sockaddr *)&hrdrAddr, sizeof(hrdrAddr)) != sizeof(int))
+void TimerStop(struct Timer *t)
+{
+    if (t->pprev == NULL)
     {
-        DieWithError("sendto() sent to the hairdresser a different number of bytes than expected");
+        return;
     }
-    sprintf(str, "Client %d leaves the queue for a haircut\n", pid);
-    write(info_pipe[1], str, strlen(str));
+    *t->pprev = t->next;
+    if (t->next != NULL)
+        t->next->pprev = t->pprev;
+    t->pprev = NULL;
+    wheel->pending--;
+    /* used may keep a stale bit, which only costs an empty visit */
+}
 
-    /* Receive notification about the end of the haircut */
-    if ((recvMsgSize = recvfrom(servHrdrSock, &pid, sizeof(int), 0, (struct sockaddr *)NULL, 0)) < 0)
+/* fn(t) runs from the loop of this thread ms from now, unless stopped. Restarting a pending timer moves it */
+void TimerStart(struct Timer *t, long ms, void (*fn)(struct Timer *t))
+{
+    TimerStop(t);
+    t->fn = fn;
+    t->expires = (ElapsedMs(&wheel->start) + ms + TICK_MS - 1) / TICK_MS; /* Never early */
+    if (t->expires <= wheel->now)
+        t->expires = wheel->now + 1;
+    wheelInsert(t);
+    wheel->pending++;
+}
+
+int TimerPending(const struct Timer *t)
+{
+    return t->pprev != NULL;
+}
+
+/* Move the timers of a slot one level down, now that its turn has come */
+static void cascade(int level)
+{
+    int slot = (wheel->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    struct Timer *t = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->used[level] &= ~((uint64_t)1 << slot);
+    while (t != NULL)
     {
-        DieWithError("recvfrom() from hairdresser failed");
+        struct Timer *next = t->next;
+        wheelInsert(t);
+        t = next;
+    }
+    if (slot == 0 && level + 1 < WHEEL_LEVELS)
+    {
+        cascade(level + 1);
     }
-    sprintf(str, "Client %d got a haircut\nHaidresser is sleeping\n", pid);
-    write(info_pipe[1], str, strlen(str));
+}
 
-    /* Release client */
-    if (sendto(servClntSock, &pid, sizeof(int), 0, (struct sockaddr *)&echoClntAddr, sizeof(echoClntAddr)) != sizeof(int))
+/* Next tick after wheel->now that has timers to run or to move down, 0 if there are none */
+uint64_t NextTick()
+{
+    uint64_t next = 0;
+    if (wheel->used[0] != 0)
+    {
+        /* Level 0 holds ticks wheel->now + 1 .. wheel->now + 64, in slot order after the current one */
+        int from = (wheel->now + 1) & (WHEEL_SLOTS - 1);
+        uint64_t rotated = (wheel->used[0] >> from) | (from > 0 ? wheel->used[0] << (WHEEL_SLOTS - from) : 0);
+        next = wheel->now + 1 + __builtin_ctzll(rotated);
+    }
+    for (int level = 1; level < WHEEL_LEVELS; level++)
     {
-        DieWithError("sendto() sent to the client a different number of bytes than expected");
+        if (wheel->used[level] != 0)
+        {
+            /* Upper levels only move at the next wrap of level 0 */
+            uint64_t wrap = (wheel->now | (WHEEL_SLOTS - 1)) + 1;
+            if (next == 0 || wrap < next)
+                next = wrap;
+            break;
+        }
     }
-    sprintf(str, "Client %d left\n", pid);
-    write(info_pipe[1], str, strlen(str));
+    return next;
 }
 
-void *AcceptObserver()
+/* Run every timer that is due */
+void TimerAdvance()
 {
-    struct sockaddr_in obsrvAddr;
-    int recvMsgSize;
-    int h;
-    unsigned int clntLen;
-    clntLen = sizeof(obsrvAddr);
-    for (;;)
+    uint64_t now = NowTick();
+    uint64_t next;
+
+    while ((next = NextTick()) != 0 && next <= now)
     {
-        if ((recvMsgSize = recvfrom(servObsrvSock, &h, sizeof(int), 0, (struct sockaddr *)&obsrvAddr, &clntLen)) < 0)
+        wheel->now = next;
+        if ((wheel->now & (WHEEL_SLOTS - 1)) == 0)
         {
-            DieWithError("recvfrom() failed");
+            cascade(1);
         }
-        for (int i = 0; i < 15; i++)
+        int slot = wheel->now & (WHEEL_SLOTS - 1);
+        wheel->used[0] &= ~((uint64_t)1 << slot);
+        /* Callbacks may start and stop timers, including ones in this slot */
+        struct Timer *t;
+        while ((t = wheel->slots[0][slot]) != NULL)
         {
-            if (observers[i].is_active == 0)
-            {
-                printf("Set observer to position %d\n", i);
-                observers[i].addr = obsrvAddr;
-                observers[i].is_active = 1;
-                break;
-            }
+            TimerStop(t);
+            long lag = ElapsedMs(&wheel->start) - (long)(t->expires * TICK_MS);
+            wheel->lagTotalMs += lag;
+            if (lag > wheel->lagMaxMs)
+                wheel->lagMaxMs = lag;
+            wheel->fired++;
+            t->fn(t);
         }
     }
+    if (now > wheel->now)
+    {
+        wheel->now = now;
+    }
 }
 
-void setObservers()
+/* Point timerfd at the next tick with work. Only a syscall when that changes */
+void TimerRearm()
 {
-    for (int i = 0; i < 15; i++)
+    struct itimerspec its;
+    uint64_t next = NextTick();
+
+    if (next == wheel->armed)
+    {
+        return;
+    }
+    memset(&its, 0, sizeof(its));
+    if (next != 0)
+    {
+        its.it_value.tv_sec = wheel->start.tv_sec + next * TICK_MS / 1000;
+        its.it_value.tv_nsec = wheel->start.tv_nsec + (next * TICK_MS % 1000) * 1000000;
+        if (its.it_value.tv_nsec >= 1000000000)
+        {
+            its.it_value.tv_sec++;
+            its.it_value.tv_nsec -= 1000000000;
+        }
+    }
+    if (timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
     {
-        observers[i].is_active = 0;
+        DieWithError("timerfd_settime() failed");
     }
+    wheel->armed = next;
+}
 
-    pthread_t thread;
-    pthread_create(&thread, NULL, AcceptObserver, NULL);
+void TimerInit(struct Wheel *w)
+{
+    memset(w, 0, sizeof(*w));
+    clock_gettime(CLOCK_MONOTONIC, &w->start);
+    if ((w->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+    {
+        DieWithError("timerfd_create() failed");
+    }
 }
 
-void *WriteInfo()
+/* timerfd fired */
+void HandleTimers()
 {
-    char str[150];
-    ssize_t rdBytes;
-    for (;;)
+    uint64_t expirations;
+    read(wheel->fd, &expirations, sizeof(expirations));
+    wheel->armed = 0;
+    TimerAdvance();
+}
+
+/* Every chair of every hairdresser of a salon. A hairdresser registers with
+   the number of chairs it has, gets as many consecutive ones, and each is a
+   slot for one visitor. It is declared dead when it is silent for
+   HEARTBEAT_MISSES heartbeats or a haircut takes twice the expected time.
+   Its clients go back to the front of the queue, its chairs are freed,
+   and it may register again */
+struct Chair
+{
+    struct Salon *salon;
+    int id;                    /* Its number in the salon */
+    struct Hairdresser *owner; /* NULL if the chair is free to register */
+    int busy;
+    struct Visitor visitor; /* Who is getting a haircut */
+    int64_t seated;         /* When, CLOCK_MONOTONIC ns */
+    struct Timer overdue;
+    int idleAt; /* Position in idleChairs[], -1 if not there */
+};
+
+struct Hairdresser
+{
+    struct Salon *salon;
+    struct Peer peer;
+    int alive;
+    int firstChair;
+    int chairs;
+    int busy; /* Chairs with somebody in them */
+    struct Timer silence;
+    struct timespec seen;   /* Last message */
+    struct timespec lostAt; /* When it was declared dead */
+    long silentMs;          /* How long it had been silent by then */
+    pid_t pid;              /* 0 if it didn't tell */
+};
+
+/* A waiting visitor. Queued in a doubly linked list, so that whoever gives
+   up leaves in O(1), and chained by peer and ticket to be found for that */
+struct Waiter
+{
+    struct Visitor v;
+    struct Waiter *prev; /* Toward the front of the queue */
+    struct Waiter *next;
+    struct Waiter *chain; /* Same hash, or free nodes */
+};
+
+/* The day of one salon so far, for the end-of-day report. Constant memory
+   however many come: running moments and P-square quantiles, no samples.
+   Written by the thread of the shard, read by the report thread under lock */
+struct DayStats
+{
+    pthread_mutex_t lock;
+    struct Welford wait; /* s, from arrival to the chair */
+    struct Welford service;
+    struct P2Quantile waitQ[3];
+    struct P2Quantile serviceQ[3];
+    int peakQueue;
+    long peakMs;   /* When, since the server started */
+    time_t peakAt; /* The same, on the wall clock */
+    double busyNs; /* Haircuts done or cut short */
+    double chairNs; /* Chairs open, until chairsSince */
+    int chairsOpen;
+    int64_t chairsSince;
+};
+
+/* One of the salons the server hosts. Only the thread of its shard touches it */
+struct Salon
+{
+    uint32_t id;
+    struct Salon *next; /* In its shard */
+
+    /* Waiting visitors, oldest first */
+    struct Waiter *head;
+    struct Waiter *tail;
+    int queueLen;
+    struct Waiter **buckets; /* By WaiterHash(), a power of 2 of them */
+    int bucketCount;
+    struct Waiter *spare; /* Nodes of visitors who left the queue */
+
+    struct Chair *chairs[MAX_CHAIRS];       /* Allocated as hairdressers register */
+    struct Hairdresser *hrdrs[MAX_CHAIRS]; /* Each has at least one chair */
+    int hrdrCount;
+    int idleChairs[MAX_CHAIRS]; /* Free chairs of live hairdressers */
+    int idleCount;
+
+    /* Hairdressers the autoscaler started */
+    struct Spawned *spawned;
+    int spawnedCount;
+    int spawnedCap;
+    struct Timer scale;
+    struct timespec calmSince; /* Of the wait under half the target, 0 if it isn't */
+
+    /* For the gossip thread, as of the end of the last round */
+    atomic_int waitMs;
+    atomic_int shownQueueLen;
+    atomic_int shownChairs;
+
+    /* Printed on shutdown, and read by the report thread */
+    atomic_ulong visits;
+    atomic_ulong served;
+    atomic_ulong turnedAway;
+    atomic_ulong abandoned; /* Gave up waiting */
+    atomic_ulong redirected;
+    struct DayStats day;
+    struct Histogram hops[HOPS];
+};
+
+/* Salons are spread over shards by id, and each shard is run by one thread:
+   its own worker with -w, otherwise the main thread. The main thread does
+   all the receiving and passes every message on to the shard of its salon,
+   so a busy salon only holds up the others of its shard */
+#define SALON_SLOTS (2 * MAX_SALONS) /* Open addressing, at most half full */
+
+#define INBOX_CLIENT 1
+#define INBOX_HRDR 2
+#define INBOX_PARK 3 /* Stop for a handoff */
+
+/* The messages a salon gets, as far as their size goes */
+union Routed
+{
+    int pid;
+    struct ClientRequest req;
+    struct GroupRequest group;
+    struct Register reg;
+    struct JobDone done;
+};
+
+struct Inbound
+{
+    int kind;
+    int len;
+    uint32_t salon;
+    struct Peer from;
+    char data[sizeof(union Routed)];
+};
+
+/* Inbound messages of one main loop round go to a shard in a single write(), atomic up to PIPE_BUF */
+#define INBOX_BATCH (4096 / sizeof(struct Inbound))
+
+struct Shard
+{
+    struct Salon *salons[SALON_SLOTS]; /* By id. Never removed */
+    _Atomic(struct Salon *) first; /* Published last, so the gossip thread may walk the list */
+    struct Wheel wheel;
+    int inbox[2]; /* Pipe from the main thread, with -w */
+    pthread_t thread;
+
+    /* Owned by the main thread */
+    struct Inbound out[INBOX_BATCH];
+    int outCount;
+    unsigned long dropped; /* Messages lost because the inbox was full */
+};
+
+struct Shard *shards;
+int shardCount = 1;
+int workerCount; /* 0: the main thread runs the only shard */
+atomic_int salonCount;
+sem_t shardParked;
+__thread int ioThread; /* Does the receiving, and may queue sends on the io_uring */
+
+/* Salon each SEQPACKET connection last spoke for, by descriptor, so that
+   its hangup goes to the same shard. Main thread only */
+uint32_t *connSalon;
+int connSalonLen;
+
+/* Events of one main loop round go to the writer in a single write().
+   Up to PIPE_BUF bytes it is atomic, so the writer never sees half an event */
+#define REPORT_BATCH (4096 / sizeof(struct SalonEvent))
+
+__thread struct SalonEvent reports[REPORT_BATCH];
+__thread int reportCount;
+
+void FlushReports()
+{
+    if (reportCount == 0)
     {
-        rdBytes = read(info_pipe[0], str, 150);
-        if (rdBytes < 0)
-        {
-            DieWithError("Can't read from pipe");
-        }
-        str[rdBytes] = '\0';
-        pthread_mutex_lock(&mutex);
-        for (int i = 0; i < 15; ++i)
-        {
-            if (observers[i].is_active == 1)
-            {
-                if (sendto(servObsrvSock, &str, strlen(str), 0, (struct sockaddr *)&observers[i].addr, sizeof(observers[i].addr)) != strlen(str))
-                {
-                    observers[i].is_active = 0;
-                    printf("Observer is absent\n");
-                }
-            }
-        }
-        pthread_mutex_unlock(&mutex);
+        return;
     }
+    /* Never wait for the writer: the pipe is non-blocking */
+    if (write(info_pipe[1], reports, reportCount * sizeof(struct SalonEvent)) < 0)
+    {
+        lostEvents += reportCount;
+    }
+    reportCount = 0;
 }
 
-void StartWriter()
+/* End-of-day report (-R): rewritten on SIGUSR1 and on shutdown */
+const double dayQuantiles[3] = {0.5, 0.9, 0.99};
+char *reportPath;
+
+void DayInit(struct DayStats *d)
 {
-    if (pipe(info_pipe) < 0)
+    pthread_mutex_init(&d->lock, NULL);
+    for (int q = 0; q < 3; q++)
     {
-        DieWithError("Can\'t open the info pipe\n");
+        P2Init(&d->waitQ[q], dayQuantiles[q]);
+        P2Init(&d->serviceQ[q], dayQuantiles[q]);
     }
+}
 
-    pthread_t thread;
-    pthread_create(&thread, NULL, WriteInfo, NULL);
+/* The numbers of a day, not its lock */
+void DayCopy(struct DayStats *to, const struct DayStats *from)
+{
+    size_t skip = offsetof(struct DayStats, wait);
+    memcpy((char *)to + skip, (const char *)from + skip, sizeof(*to) - skip);
+}
+
+/* Chairs open from now on, for the utilization. Lock held */
+void DayChairs(struct DayStats *d, int change, int64_t now)
+{
+    if (d->chairsOpen > 0)
+        d->chairNs += (double)d->chairsOpen * (now - d->chairsSince);
+    d->chairsOpen += change;
+    if (d->chairsOpen < 0)
+        d->chairsOpen = 0;
+    d->chairsSince = now;
 }
 
-void sigfunc(int sig)
+/* Fold what an event tells about the day. Its chair is as the event left it */
+void DayFold(struct Salon *s, int type, pid_t pid, int chair)
 {
-    if (sig != SIGINT && sig != SIGTERM)
+    struct DayStats *d = &s->day;
+    struct Chair *ch = type != EV_QUEUED && type != EV_ABANDONED ? s->chairs[chair] : NULL;
+    int64_t now = TraceNow();
+
+    pthread_mutex_lock(&d->lock);
+    switch (type)
     {
-        return;
+    case EV_OPEN:
+        DayChairs(d, 1, now);
+        break;
+    case EV_DISPATCHED:
+        ch->seated = now;
+        WelfordAdd(&d->wait, (now - ch->visitor.arrived) / 1e9);
+        for (int q = 0; q < 3; q++)
+            P2Add(&d->waitQ[q], (now - ch->visitor.arrived) / 1e9);
+        break;
+    case EV_SERVED:
+        d->busyNs += now - ch->seated;
+        WelfordAdd(&d->service, (now - ch->seated) / 1e9);
+        for (int q = 0; q < 3; q++)
+            P2Add(&d->serviceQ[q], (now - ch->seated) / 1e9);
+        break;
+    case EV_LOST:
+        if (pid != 0)
+            d->busyNs += now - ch->seated; /* Cut short */
+        DayChairs(d, -1, now);
+        break;
+    case EV_CLOSED:
+        DayChairs(d, -1, now);
+        break;
+    }
+    if (s->queueLen > d->peakQueue)
+    {
+        d->peakQueue = s->queueLen;
+        d->peakMs = ElapsedMs(&startTime);
+        d->peakAt = time(NULL);
     }
+    pthread_mutex_unlock(&d->lock);
+}
 
-    close(servClntSock);
-    close(servHrdrSock);
-    close(servObsrvSock);
-    pthread_mutex_destroy(&mutex);
-    close(info_pipe[0]);
-    close(info_pipe[1]);
-    printf("disconnected\n");
-    exit(0);
+void Report(struct Salon *s, int type, pid_t pid, int chair)
+{
+    if (reportPath != NULL)
+    {
+        DayFold(s, type, pid, chair);
+    }
+
+    struct SalonEvent *ev = &reports[reportCount++];
+    ev->seq = 0; /* Numbered by the writer */
+    ev->timeMs = ElapsedMs(&startTime);
+    ev->type = type;
+    ev->pid = pid;
+    ev->hairdresser = chair;
+    ev->salon = s->id;
+    if (reportCount == REPORT_BATCH)
+    {
+        FlushReports();
+    }
 }
 
-int main(int argc, char *argv[])
+/* Optional io_uring backend of the main thread (-u). Client and hairdresser
+   datagrams arrive through multishot receives into provided buffers, and
+   sends are queued and go to the kernel together with the next wait */
+int useUring;
+struct Uring ring;
+struct UringBufRing recvBufs;
+struct msghdr recvShape; /* What a multishot recvmsg fills in: a sockaddr_in, no control */
+
+#define URING_ENTRIES 512
+#define RECV_BUFS 256
+#define RECV_BUF_BYTES 256
+
+#define TAG_CLIENT 1
+#define TAG_HRDR 2
+#define TAG_HANDOFF 3
+#define TAG_TIMER 4
+#define TAG_SHUTDOWN 5
+#define TAG_CANCEL 6
+#define TAG_SEND 7 /* user_data is TAG_SEND | slot << 8 */
+
+int armed[TAG_SHUTDOWN + 1]; /* Receive or poll in flight */
+int handoffReady;
+int shutdownReady;
+
+/* Sends in flight */
+#define SEND_SLOTS 256
+
+struct SendSlot
 {
-    signal(SIGINT, sigfunc);
-    signal(SIGTERM, sigfunc);
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_storage addr;
+    char data[sizeof(struct ClientStatus) + sizeof(struct Job)]; /* Anything the server sends */
+};
+
+struct SendSlot sendSlots[SEND_SLOTS];
+int freeSlots[SEND_SLOTS];
+int freeSlotCount;
 
-    unsigned int servClntPort;
-    unsigned int servHrdrPort;
-    unsigned int servObsrvPort;
+/* Send to a UDP or SEQPACKET peer. With io_uring the main thread's sends are only queued */
+ssize_t SendTo(struct Transport *t, const void *buf, int len, const struct Peer *to, int flags)
+{
+    struct io_uring_sqe *sqe = NULL;
 
-    if (argc != 5) /* Test for correct number of arguments */
+    if (useUring && ioThread && freeSlotCount > 0 && len <= (int)sizeof(sendSlots[0].data))
     {
-        fprintf(stderr, "Usage:  %s <Server Address> <Port for Clients> <Port for Haidresser>\n", argv[0]);
-        exit(1);
+        sqe = UringSqe(&ring);
+    }
+    if (sqe == NULL)
+    {
+        return TransportSend(t, buf, len, to, flags);
     }
+    int slot = freeSlots[--freeSlotCount];
+    struct SendSlot *s = &sendSlots[slot];
+    memcpy(s->data, buf, len);
+    memcpy(&s->addr, &to->addr, to->addrLen);
+    s->iov.iov_base = s->data;
+    s->iov.iov_len = len;
+    memset(&s->msg, 0, sizeof(s->msg));
+    s->msg.msg_name = &s->addr;
+    s->msg.msg_namelen = to->addrLen;
+    s->msg.msg_iov = &s->iov;
+    s->msg.msg_iovlen = 1;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = t->fd;
+    sqe->addr = (unsigned long)&s->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_DONTWAIT;
+    sqe->user_data = TAG_SEND | (uint64_t)slot << 8;
+    return len;
+}
+
+static uint32_t WaiterHash(const struct Peer *p, uint32_t ticket)
+{
+    uint32_t h = 2166136261u ^ ticket; /* FNV-1a */
+    const unsigned char *b = (const unsigned char *)&p->addr;
+    int len = p->fd >= 0 ? 0 : (int)p->addrLen;
 
-    in_addr_t servAddr;
-    if ((servAddr = inet_addr(argv[1])) < 0)
+    h = (h ^ (uint32_t)p->fd) * 16777619u;
+    for (int i = 0; i < len; i++)
     {
-        DieWithError("Invalid address");
+        h = (h ^ b[i]) * 16777619u;
     }
+    return h;
+}
 
-    servClntPort = atoi(argv[2]);
-    servHrdrPort = atoi(argv[3]);
-    servObsrvPort = atoi(argv[4]);
+static void chainWaiter(struct Salon *s, struct Waiter *w)
+{
+    struct Waiter **b = &s->buckets[WaiterHash(&w->v.peer, w->v.ticket) & (s->bucketCount - 1)];
+    w->chain = *b;
+    *b = w;
+}
 
-    servClntSock = createSocket(servClntPort, servAddr);
-    servHrdrSock = createSocket(servHrdrPort, servAddr);
-    servObsrvSock = createSocket(servObsrvPort, servAddr);
+/* A node for v, with room in the hash for it */
+static struct Waiter *newWaiter(struct Salon *s, const struct Visitor *v)
+{
+    struct Waiter *w;
 
-    /* Block until receive message from the hairdresser */
-    int recvMsgSize;
-    int h;
-    unsigned int clntLen;
-    clntLen = sizeof(hrdrAddr);
-    if ((recvMsgSize = recvfrom(servHrdrSock, &h, sizeof(int), 0, (struct sockaddr *)&hrdrAddr, &clntLen)) < 0)
+    if (s->queueLen >= s->bucketCount)
     {
-        DieWithError("recvfrom() failed");
+        int count = s->bucketCount > 0 ? s->bucketCount * 2 : 16;
+        free(s->buckets);
+        if ((s->buckets = calloc(count, sizeof(*s->buckets))) == NULL)
+            DieWithError("calloc() failed");
+        s->bucketCount = count;
+        for (w = s->head; w != NULL; w = w->next)
+            chainWaiter(s, w);
     }
+    if ((w = s->spare) != NULL)
+        s->spare = w->chain;
+    else if ((w = malloc(sizeof(*w))) == NULL)
+        DieWithError("malloc() failed");
+    w->v = *v;
+    chainWaiter(s, w);
+    s->queueLen++;
+    return w;
+}
 
-    setObservers();
-    pthread_mutex_init(&mutex, NULL);
-    StartWriter();
+void Enqueue(struct Salon *s, const struct Visitor *v)
+{
+    struct Waiter *w = newWaiter(s, v);
+    w->prev = s->tail;
+    w->next = NULL;
+    if (s->tail != NULL)
+        s->tail->next = w;
+    else
+        s->head = w;
+    s->tail = w;
+}
 
-    char str[150];
-    sprintf(str, "Hairdresser's is open\n");
-    write(info_pipe[1], str, strlen(str));
+/* Back to where the visitor was before the hairdresser let it down */
+void EnqueueFront(struct Salon *s, const struct Visitor *v)
+{
+    struct Waiter *w = newWaiter(s, v);
+    w->prev = NULL;
+    w->next = s->head;
+    if (s->head != NULL)
+        s->head->prev = w;
+    else
+        s->tail = w;
+    s->head = w;
+}
 
-    for (;;)
+/* The waiting visitor with the ticket, NULL if there is none */
+struct Waiter *FindWaiter(struct Salon *s, const struct Peer *p, uint32_t ticket)
+{
+    if (s->bucketCount == 0)
+    {
+        return NULL;
+    }
+    for (struct Waiter *w = s->buckets[WaiterHash(p, ticket) & (s->bucketCount - 1)]; w != NULL; w = w->chain)
+    {
+        if (w->v.ticket == ticket && PeerEqual(&w->v.peer, p))
+            return w;
+    }
+    return NULL;
+}
+
+/* Take a visitor out of the queue, from anywhere in it */
+struct Visitor Unqueue(struct Salon *s, struct Waiter *w)
+{
+    struct Waiter **b = &s->buckets[WaiterHash(&w->v.peer, w->v.ticket) & (s->bucketCount - 1)];
+    while (*b != w)
+    {
+        b = &(*b)->chain;
+    }
+    *b = w->chain;
+    if (w->prev != NULL)
+        w->prev->next = w->next;
+    else
+        s->head = w->next;
+    if (w->next != NULL)
+        w->next->prev = w->prev;
+    else
+        s->tail = w->prev;
+    w->chain = s->spare;
+    s->spare = w;
+    s->queueLen--;
+    return w->v;
+}
+
+struct Visitor Dequeue(struct Salon *s)
+{
+    return Unqueue(s, s->head);
+}
+
+/* Tell the client how its visit is going. Old clients only hear when it's over */
+int Notify(const struct Visitor *v, int status)
+{
+    struct ClientStatus st;
+
+    if (v->detached)
+    {
+        return -1;
+    }
+    if (v->legacy)
+    {
+        if (status == VISIT_QUEUED || status == VISIT_IN_CHAIR)
+            return 0;
+        return SendTo(&servClnt, &v->pid, sizeof(int), &v->peer, MSG_DONTWAIT) == sizeof(int) ? 0 : -1;
+    }
+    st.magic = REQUEST_MAGIC;
+    st.ticket = v->ticket;
+    if (v->together)
+    {
+        /* The party was told it is queued when it came, and hears again when it is over */
+        if (status == VISIT_QUEUED || status == VISIT_IN_CHAIR)
+            return 0;
+        st.ticket = v->group;
+    }
+    st.status = status;
+    StampNow(&st.sent, 0, STAMP_SYNCED);
+    return SendTo(&servClnt, &st, sizeof(st), &v->peer, MSG_DONTWAIT) == sizeof(st) ? 0 : -1;
+}
+
+/* One more member of the visitor's party is done. Returns 1 if it was the
+   last, or came alone */
+int PartyDone(const struct Visitor *v)
+{
+    if (v->party == NULL)
+    {
+        return 1;
+    }
+    if (--v->party->left > 0)
+    {
+        return 0;
+    }
+    free(v->party);
+    return 1;
+}
+
+/* The visit is over. An old client's connection goes with it,
+   a new one keeps it for other visits until it hangs up */
+void Finish(const struct Visitor *v, int status)
+{
+    if (!PartyDone(v))
+    {
+        /* The party hears once its last member is done */
+        return;
+    }
+    if (Notify(v, status) < 0)
+    {
+        /* Nobody to release, the client has already hung up */
+        printf("Client %d is gone\n", v->pid);
+    }
+    if (v->legacy && !v->detached)
+    {
+        TransportHangup(&servClnt, &v->peer);
+    }
+}
+
+/* The client gave up waiting */
+void Cancel(struct Salon *s, const struct Visitor *v)
+{
+    struct Waiter *w = FindWaiter(s, &v->peer, v->ticket);
+    if (w != NULL)
+    {
+        struct Visitor gone = Unqueue(s, w);
+        printf("Client %d cancelled\n", gone.pid);
+        s->abandoned++;
+        TraceAsync("queued", 'e', gone.pid);
+        Report(s, EV_ABANDONED, gone.pid, 0);
+        Finish(&gone, VISIT_CANCELLED);
+        return;
+    }
+    /* Only chairs of live hairdressers can be busy */
+    for (int h = 0; h < s->hrdrCount; h++)
+    {
+        struct Hairdresser *hd = s->hrdrs[h];
+        for (int c = hd->firstChair; hd->alive && c < hd->firstChair + hd->chairs; c++)
+        {
+            struct Chair *ch = s->chairs[c];
+            if (ch->busy && ch->visitor.ticket == v->ticket && PeerEqual(&ch->visitor.peer, &v->peer))
+            {
+                /* Too late, the haircut is under way */
+                Notify(&ch->visitor, VISIT_IN_CHAIR);
+            }
+        }
+    }
+}
+
+/* A SEQPACKET client hung up: whatever it was waiting for is off */
+void ClientGone(struct Salon *s, const struct Peer *p)
+{
+    struct Waiter *next;
+    for (struct Waiter *w = s->head; w != NULL; w = next)
+    {
+        next = w->next;
+        if (PeerEqual(&w->v.peer, p))
+        {
+            struct Visitor gone = Unqueue(s, w);
+            printf("Client %d is gone\n", gone.pid);
+            s->abandoned++;
+            TraceAsync("queued", 'e', gone.pid);
+            Report(s, EV_ABANDONED, gone.pid, 0);
+            PartyDone(&gone);
+        }
+    }
+    for (int h = 0; h < s->hrdrCount; h++)
+    {
+        struct Hairdresser *hd = s->hrdrs[h];
+        for (int c = hd->firstChair; hd->alive && c < hd->firstChair + hd->chairs; c++)
+        {
+            if (s->chairs[c]->busy && PeerEqual(&s->chairs[c]->visitor.peer, p))
+                s->chairs[c]->visitor.detached = 1;
+        }
+    }
+    TransportHangup(&servClnt, p);
+}
+
+/* Answer a clock offset probe from a client or hairdresser */
+int ClockSyncMessage(struct Transport *t, const void *msg, int recvMsgSize, const struct Peer *from)
+{
+    struct ClockSync sync;
+    struct Stamp now;
+
+    if (recvMsgSize != sizeof(sync))
+    {
+        return 0;
+    }
+    memcpy(&sync, msg, sizeof(sync));
+    if (sync.magic != SYNC_MAGIC)
+    {
+        return 0;
+    }
+    StampNow(&now, 0, STAMP_SYNCED);
+    sync.t2 = now.mono;
+    StampNow(&now, 0, STAMP_SYNCED);
+    sync.t3 = now.mono;
+    SendTo(t, &sync, sizeof(sync), from, MSG_DONTWAIT);
+    return 1;
+}
+
+/* Chairs of live hairdressers */
+int LiveChairs(const struct Salon *s)
+{
+    int chairs = 0;
+    for (int h = 0; h < s->hrdrCount; h++)
+    {
+        if (s->hrdrs[h]->alive)
+            chairs += s->hrdrs[h]->chairs;
+    }
+    return chairs;
+}
+
+/* How long a visitor arriving now would wait, going by the expected haircut time. -1 if nobody cuts */
+int ExpectedWaitMs(const struct Salon *s, int chairs)
+{
+    if (chairs == 0)
+    {
+        return -1;
+    }
+    if (s->queueLen < s->idleCount)
+    {
+        return 0;
+    }
+    return (long)(s->queueLen - s->idleCount + 1) * serviceMs / chairs;
+}
+
+/* Send a newcomer to the peer server with the shortest wait, if it is
+   shorter than here by half a haircut, as the news may be GOSSIP_MS old.
+   Only UDP clients can follow, and only fresh visits go, so none ping-pongs */
+int Redirect(struct Salon *s, const struct Visitor *v, const struct ClientRequest *req)
+{
+    struct ClientRedirect rd;
+    struct GossipSalon *best = NULL;
+    struct sockaddr_in where;
+    char addr[INET_ADDRSTRLEN];
+    int wait;
+    int there;
+
+    if (peerServerCount == 0 || v->peer.fd >= 0 || req->redirects > 0 || (wait = ExpectedWaitMs(s, LiveChairs(s))) == 0)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&peersLock);
+    for (int i = 0; i < peerServerCount; i++)
+    {
+        struct PeerServer *p = &peerServers[i];
+        if (p->clients.sin_port == 0 || ElapsedMs(&p->heard) > GOSSIP_STALE_MS)
+            continue;
+        for (int j = 0; j < p->count; j++)
+        {
+            struct GossipSalon *g = &p->salons[j];
+            if (g->salon == s->id && g->waitMs >= 0 && (best == NULL || g->waitMs < best->waitMs))
+            {
+                best = g;
+                where = p->clients;
+            }
+        }
+    }
+    if (best == NULL || (wait >= 0 && best->waitMs + serviceMs / 2 >= wait))
+    {
+        pthread_mutex_unlock(&peersLock);
+        return 0;
+    }
+    there = best->waitMs;
+    /* Count the newcomer in until the peer tells again, so that a burst doesn't all go one way */
+    best->queueLen++;
+    best->waitMs += serviceMs / (best->chairs > 0 ? best->chairs : 1);
+    memset(&rd, 0, sizeof(rd));
+    rd.magic = REDIRECT_MAGIC;
+    rd.ticket = v->ticket;
+    rd.addr = where.sin_addr.s_addr;
+    rd.port = where.sin_port;
+    pthread_mutex_unlock(&peersLock);
+
+    inet_ntop(AF_INET, &where.sin_addr, addr, sizeof(addr));
+    printf("Client %d is sent to %s:%d, %d ms wait there against %d here\n", v->pid, addr, ntohs(rd.port), there,
+           wait);
+    s->redirected++;
+    SendTo(&servClnt, &rd, sizeof(rd), &v->peer, MSG_DONTWAIT);
+    return 1;
+}
+
+/* A party: all of it joins the queue, one behind the other, or none of it does */
+void GroupArrived(struct Salon *s, const void *msg, struct Visitor *v, uint64_t start)
+{
+    struct GroupRequest g;
+    char name[64];
+
+    memcpy(&g, msg, sizeof(g));
+    if (g.count < 1 || g.count > MAX_GROUP)
+    {
+        return;
+    }
+    v->legacy = 0;
+    v->group = g.req.ticket;
+    v->together = (g.flags & GROUP_TOGETHER) != 0;
+    printf("Handling a party of %u from %s\n", g.count, PeerName(&v->peer, name, sizeof(name)));
+    s->visits += g.count;
+    if (maxWaiting > 0 && s->queueLen + (int)g.count > maxWaiting)
+    {
+        printf("Party of client %d is turned away\n", g.visitors[0]);
+        s->turnedAway += g.count;
+        for (uint32_t i = 0; i < (v->together ? 1 : g.count); i++)
+        {
+            v->pid = g.visitors[i];
+            v->ticket = g.req.ticket + i;
+            Finish(v, VISIT_REJECTED);
+        }
+        TraceSlice("reject", start, g.visitors[0]);
+        return;
+    }
+    if (v->together)
+    {
+        if ((v->party = calloc(1, sizeof(*v->party))) == NULL)
+            DieWithError("calloc() failed");
+        v->party->left = g.count;
+    }
+    for (uint32_t i = 0; i < g.count; i++)
+    {
+        v->pid = g.visitors[i];
+        v->ticket = g.req.ticket + i;
+        Enqueue(s, v);
+        Report(s, EV_QUEUED, v->pid, 0);
+        Notify(v, VISIT_QUEUED);
+        TraceFlow('t', start, v->pid);
+        TraceAsync("queued", 'b', v->pid);
+    }
+    if (v->together)
+    {
+        struct Visitor all = *v;
+        all.together = 0;
+        all.ticket = v->group;
+        Notify(&all, VISIT_QUEUED);
+    }
+    TraceSlice("arrive", start, g.visitors[0]);
+}
+
+void ClientMessage(struct Salon *s, const void *msg, int recvMsgSize, const struct Peer *from)
+{
+    struct Visitor v;
+    struct ClientRequest req;
+    struct Stamp now;
+    char name[64];
+    uint64_t start = TraceNow();
+
+    StampNow(&now, 0, STAMP_SYNCED);
+    v.peer = *from;
+    v.detached = 0;
+    v.arrived = now.mono;
+    v.group = 0;
+    v.together = 0;
+    v.party = NULL;
+    if (recvMsgSize == 0)
+    {
+        /* Only a connection hangs up. Over UDP an empty datagram means nothing */
+        if (from->fd >= 0)
+            ClientGone(s, &v.peer);
+        return;
+    }
+    memcpy(&req, msg, recvMsgSize < (int)sizeof(req) ? recvMsgSize : (int)sizeof(req));
+    if (recvMsgSize == sizeof(int))
+    {
+        /* Old client: its pid is all we get */
+        v.pid = req.magic;
+        v.ticket = v.pid;
+        v.legacy = 1;
+    }
+    else if (recvMsgSize == sizeof(req) && req.magic == REQUEST_MAGIC)
+    {
+        v.pid = req.visitor;
+        v.ticket = req.ticket;
+        v.legacy = 0;
+        if (req.type == REQ_CANCEL)
+        {
+            Cancel(s, &v);
+            return;
+        }
+        if (req.type == REQ_RECEIPT)
+        {
+            HistAdd(&s->hops[HOP_SERVER_CLIENT], HopNs(&req.echo, &req.sent));
+            return;
+        }
+        if (req.type != REQ_VISIT || Redirect(s, &v, &req))
+            return;
+        HistAdd(&s->hops[HOP_CLIENT_SERVER], HopNs(&req.sent, &now));
+    }
+    else if (recvMsgSize == sizeof(struct GroupRequest) && req.magic == REQUEST_MAGIC && req.type == REQ_GROUP)
+    {
+        HistAdd(&s->hops[HOP_CLIENT_SERVER], HopNs(&req.sent, &now));
+        GroupArrived(s, msg, &v, start);
+        return;
+    }
+    else
+    {
+        return;
+    }
+    printf("Handling %s\n", PeerName(&v.peer, name, sizeof(name)));
+    s->visits++;
+    if (maxWaiting > 0 && s->queueLen >= maxWaiting)
+    {
+        printf("Client %d is turned away\n", v.pid);
+        s->turnedAway++;
+        Finish(&v, VISIT_REJECTED);
+        TraceFlow('t', start, v.pid);
+        TraceSlice("reject", start, v.pid);
+        return;
+    }
+    Enqueue(s, &v);
+    Report(s, EV_QUEUED, v.pid, 0);
+    Notify(&v, VISIT_QUEUED);
+    TraceFlow('t', start, v.pid);
+    TraceAsync("queued", 'b', v.pid);
+    TraceSlice("arrive", start, v.pid);
+}
+
+/* Free chairs of live hairdressers, so that Dispatch() doesn't look for them */
+void ChairIdle(struct Chair *ch)
+{
+    struct Salon *s = ch->salon;
+    ch->idleAt = s->idleCount;
+    s->idleChairs[s->idleCount++] = ch->id;
+}
+
+void ChairTaken(struct Chair *ch)
+{
+    struct Salon *s = ch->salon;
+    int at = ch->idleAt;
+    if (at < 0)
+    {
+        return;
+    }
+    s->idleChairs[at] = s->idleChairs[--s->idleCount];
+    s->chairs[s->idleChairs[at]]->idleAt = at;
+    ch->idleAt = -1;
+}
+
+/* qsort() order of busy chairs, the latest arrival first */
+int LaterArrival(const void *a, const void *b)
+{
+    int64_t x = (*(struct Chair *const *)a)->visitor.arrived;
+    int64_t y = (*(struct Chair *const *)b)->visitor.arrived;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+void HairdresserLost(struct Hairdresser *hd, const char *why)
+{
+    struct Salon *s = hd->salon;
+    struct Chair *back[MAX_CHAIRS];
+    int backLen = 0;
+
+    hd->alive = 0;
+    TimerStop(&hd->silence);
+    hd->silentMs = ElapsedMs(&hd->seen);
+    clock_gettime(CLOCK_MONOTONIC, &hd->lostAt);
+    printf("Hairdresser is %s, last heard %ld ms ago\n", why, hd->silentMs);
+    for (int c = hd->firstChair; c < hd->firstChair + hd->chairs; c++)
+    {
+        struct Chair *ch = s->chairs[c];
+        ChairTaken(ch);
+        ch->owner = NULL;
+        if (ch->busy)
+            back[backLen++] = ch;
+        else
+            Report(s, EV_LOST, 0, c);
+    }
+    /* Each goes in front of the ones that came later */
+    qsort(back, backLen, sizeof(back[0]), LaterArrival);
+    for (int i = 0; i < backLen; i++)
+    {
+        struct Chair *ch = back[i];
+        printf("Client %d is back in the queue\n", ch->visitor.pid);
+        ch->busy = 0;
+        TimerStop(&ch->overdue);
+        TraceAsync("in chair", 'e', ch->visitor.pid);
+        TraceAsync("queued", 'b', ch->visitor.pid);
+        EnqueueFront(s, &ch->visitor);
+        Report(s, EV_LOST, ch->visitor.pid, ch->id);
+        Notify(&ch->visitor, VISIT_QUEUED);
+    }
+    hd->busy = 0;
+    TransportHangup(&servHrdr, &hd->peer);
+    hd->peer.fd = -1; /* Closed, and its number may come back as somebody else */
+}
+
+/* An idle hairdresser the autoscaler lets go. Its chairs simply close,
+   nobody is put back in the queue */
+void HairdresserRetired(struct Hairdresser *hd)
+{
+    struct Salon *s = hd->salon;
+
+    hd->alive = 0;
+    TimerStop(&hd->silence);
+    for (int c = hd->firstChair; c < hd->firstChair + hd->chairs; c++)
+    {
+        ChairTaken(s->chairs[c]);
+        s->chairs[c]->owner = NULL;
+        Report(s, EV_CLOSED, 0, c);
+    }
+    TransportHangup(&servHrdr, &hd->peer);
+    hd->peer.fd = -1;
+}
+
+void HairdresserSilent(struct Timer *t)
+{
+    HairdresserLost((struct Hairdresser *)((char *)t - offsetof(struct Hairdresser, silence)), "silent");
+}
+
+void HairdresserOverdue(struct Timer *t)
+{
+    struct Chair *ch = (struct Chair *)((char *)t - offsetof(struct Chair, overdue));
+    HairdresserLost(ch->owner, "overdue");
+}
+
+/* Heard from the hairdresser */
+void HairdresserSeen(struct Hairdresser *hd)
+{
+    clock_gettime(CLOCK_MONOTONIC, &hd->seen);
+    TimerStart(&hd->silence, HEARTBEAT_MS * HEARTBEAT_MISSES, HairdresserSilent);
+}
+
+/* NULL if from is not a hairdresser of the salon */
+struct Hairdresser *FindHairdresser(struct Salon *s, const struct Peer *from)
+{
+    for (int h = 0; h < s->hrdrCount; h++)
+    {
+        if (PeerEqual(&s->hrdrs[h]->peer, from))
+            return s->hrdrs[h];
+    }
+    return NULL;
+}
+
+/* First of n free consecutive chairs, -1 if there are none */
+int FindChairs(struct Salon *s, int n)
+{
+    int run = 0;
+    for (int c = 0; c < MAX_CHAIRS; c++)
+    {
+        run = s->chairs[c] == NULL || s->chairs[c]->owner == NULL ? run + 1 : 0;
+        if (run == n)
+            return c - n + 1;
+    }
+    return -1;
+}
+
+/* Chair c, made on first use */
+struct Chair *MakeChair(struct Salon *s, int c)
+{
+    if (s->chairs[c] == NULL)
+    {
+        if ((s->chairs[c] = calloc(1, sizeof(struct Chair))) == NULL)
+            DieWithError("calloc() failed");
+        s->chairs[c]->salon = s;
+        s->chairs[c]->id = c;
+        s->chairs[c]->idleAt = -1;
+    }
+    return s->chairs[c];
+}
+
+struct Spawned *SpawnedOf(struct Salon *s, pid_t pid);
+
+/* Somebody registered n chairs, or a lost hairdresser is back */
+void HairdresserFound(struct Salon *s, const struct Peer *from, int n, pid_t pid)
+{
+    struct Hairdresser *hd = FindHairdresser(s, from);
+    int first = FindChairs(s, n);
+
+    for (int i = 0; i < s->hrdrCount && hd == NULL; i++)
+    {
+        /* Somebody else's place, long gone */
+        if (!s->hrdrs[i]->alive && s->hrdrs[i]->peer.fd < 0)
+            hd = s->hrdrs[i];
+    }
+    if (hd == NULL && s->hrdrCount < MAX_CHAIRS && (hd = calloc(1, sizeof(*hd))) != NULL)
+    {
+        s->hrdrs[s->hrdrCount++] = hd;
+    }
+    if (hd == NULL || first < 0)
+    {
+        printf("No room for %d more chairs\n", n);
+        TransportHangup(&servHrdr, from);
+        return;
+    }
+    if (!PeerEqual(&hd->peer, from))
+    {
+        memset(hd, 0, sizeof(*hd));
+    }
+    hd->salon = s;
+    hd->peer = *from;
+    hd->alive = 1;
+    hd->firstChair = first;
+    hd->chairs = n;
+    hd->busy = 0;
+    hd->pid = pid;
+    HairdresserSeen(hd);
+    struct Spawned *sp = SpawnedOf(s, pid);
+    if (sp != NULL)
+        sp->registered = 1;
+    if (hd->lostAt.tv_sec != 0 || hd->lostAt.tv_nsec != 0)
+    {
+        printf("Hairdresser is back %ld ms after it was declared dead, %ld ms after it was last heard\n",
+               ElapsedMs(&hd->lostAt), ElapsedMs(&hd->lostAt) + hd->silentMs);
+    }
+    if (n > 1)
+    {
+        printf("Hairdresser with chairs %d-%d\n", first, first + n - 1);
+    }
+    for (int c = first; c < first + n; c++)
+    {
+        struct Chair *ch = MakeChair(s, c);
+        ch->owner = hd;
+        ch->busy = 0;
+        ChairIdle(ch);
+        Report(s, EV_OPEN, 0, c);
+    }
+}
+
+/* How long a chair may take before its hairdresser is given up on. -s may
+   be shorter than a haircut really is, and that alone must not do it */
+int OverdueMs()
+{
+    return 2 * (serviceMs > HAIRCUT_MS ? serviceMs : HAIRCUT_MS);
+}
+
+/* Seat whoever waits longest in every free chair */
+void Dispatch(struct Salon *s)
+{
+    struct Job job;
+
+    while (s->idleCount > 0 && s->queueLen > 0)
+    {
+        uint64_t start = TraceNow();
+        struct Chair *ch = s->chairs[s->idleChairs[s->idleCount - 1]];
+        struct Hairdresser *hd = ch->owner;
+        ChairTaken(ch);
+        ch->visitor = Dequeue(s);
+        ch->busy = 1;
+        hd->busy++;
+        pid_t pid = ch->visitor.pid;
+        TraceAsync("queued", 'e', pid);
+        TraceAsync("in chair", 'b', pid);
+        TraceFlow('t', start, pid);
+        TimerStart(&ch->overdue, OverdueMs(), HairdresserOverdue);
+        Report(s, EV_DISPATCHED, pid, ch->id);
+        Notify(&ch->visitor, VISIT_IN_CHAIR);
+
+        /* Send client to hairdresser */
+        job.visitor = pid;
+        job.chair = ch->id - hd->firstChair;
+        StampNow(&job.sent, 0, STAMP_SYNCED);
+        HistAdd(&s->hops[HOP_QUEUE], job.sent.mono - ch->visitor.arrived);
+        if (SendTo(&servHrdr, &job, sizeof(job), &hd->peer, 0) != sizeof(job))
+        {
+            HairdresserLost(hd, "unreachable");
+        }
+        TraceSlice("dispatch", start, pid);
+    }
+}
+
+/* A hairdresser given up on finished after all. Its visitor went back to
+   the queue, and must not get a second haircut: it leaves from there */
+void LateDone(struct Salon *s, const struct Hairdresser *hd, pid_t pid, const struct JobDone *done, uint64_t start)
+{
+    struct Chair *ch = NULL;
+    struct Waiter *w;
+
+    /* The chair still has the visitor it had. Old hairdressers only send the pid */
+    for (int c = hd->firstChair; c < hd->firstChair + hd->chairs && ch == NULL; c++)
+    {
+        if ((done == NULL || done->chair == (uint32_t)(c - hd->firstChair)) && !s->chairs[c]->busy &&
+            s->chairs[c]->visitor.pid == pid)
+            ch = s->chairs[c];
+    }
+    if (ch == NULL || (w = FindWaiter(s, &ch->visitor.peer, ch->visitor.ticket)) == NULL)
+    {
+        return;
+    }
+    struct Visitor gone = Unqueue(s, w);
+    printf("Client %d was done after all\n", pid);
+    s->served++;
+    TraceAsync("queued", 'e', pid);
+    Report(s, EV_LEFT, pid, 0);
+    Finish(&gone, VISIT_DONE);
+    TraceSlice("release", start, pid);
+}
+
+void HairdresserMessage(struct Salon *s, const void *msg, int recvMsgSize, const struct Peer *from)
+{
+    pid_t pid = 0;
+    struct JobDone done;
+    struct Register reg;
+    struct Stamp now;
+    int n = 0; /* Chairs, if it is a registration */
+    pid_t hrdrPid = 0;
+    uint64_t start = TraceNow();
+
+    StampNow(&now, 0, STAMP_SYNCED);
+    memset(&done, 0, sizeof(done));
+    if (recvMsgSize == sizeof(int))
+    {
+        memcpy(&pid, msg, sizeof(int));
+        n = pid != HEARTBEAT ? 1 : 0;
+    }
+    else if (recvMsgSize == sizeof(reg))
+    {
+        memcpy(&reg, msg, sizeof(reg));
+        if (reg.magic != REGISTER_MAGIC || reg.chairs > MAX_CHAIRS)
+            return;
+        /* Sent home, but this was on the way */
+        struct Spawned *sp = SpawnedOf(s, reg.pid);
+        if (sp != NULL && sp->retiring)
+            return;
+        n = reg.chairs;
+        hrdrPid = reg.pid;
+        pid = HEARTBEAT;
+    }
+    else if (recvMsgSize == sizeof(done))
+    {
+        memcpy(&done, msg, sizeof(done));
+        pid = done.visitor;
+    }
+    else if (recvMsgSize != 0 || from->fd < 0)
+    {
+        /* Empty is a hangup, and only a connection hangs up */
+        return;
+    }
+    struct Hairdresser *hd = FindHairdresser(s, from);
+    if (hd == NULL || !hd->alive)
+    {
+        if (hd != NULL && pid != HEARTBEAT && pid != 0)
+            LateDone(s, hd, pid, recvMsgSize == sizeof(done) ? &done : NULL, start);
+        /* Anybody idle may take chairs: a registration, an idle heartbeat,
+           or an old hairdresser finishing late. One still busy may not */
+        if (n > 0)
+            HairdresserFound(s, from, n, hrdrPid);
+        else if (recvMsgSize == 0)
+            TransportHangup(&servHrdr, from);
+        return;
+    }
+    if (recvMsgSize == 0)
+    {
+        HairdresserLost(hd, "disconnected");
+        return;
+    }
+    HairdresserSeen(hd);
+    if (pid == HEARTBEAT || pid == 0)
+    {
+        return;
+    }
+
+    /* Which chair: old hairdressers only send the pid */
+    struct Chair *ch = NULL;
+    if (recvMsgSize == sizeof(done))
+    {
+        if (done.chair < (uint32_t)hd->chairs)
+            ch = s->chairs[hd->firstChair + done.chair];
+    }
+    else
+    {
+        for (int i = hd->firstChair; i < hd->firstChair + hd->chairs && ch == NULL; i++)
+        {
+            if (s->chairs[i]->busy && s->chairs[i]->visitor.pid == pid)
+                ch = s->chairs[i];
+        }
+    }
+    if (ch == NULL || !ch->busy || ch->visitor.pid != pid)
+    {
+        return;
+    }
+    if (recvMsgSize == sizeof(done))
+    {
+        HistAdd(&s->hops[HOP_SERVER_HRDR], HopNs(&done.echo, &done.received));
+        HistAdd(&s->hops[HOP_HAIRCUT], HopNs(&done.received, &done.sent));
+        HistAdd(&s->hops[HOP_HRDR_SERVER], HopNs(&done.sent, &now));
+    }
+    ch->busy = 0;
+    hd->busy--;
+    s->served++;
+    TimerStop(&ch->overdue);
+    ChairIdle(ch);
+    TraceAsync("in chair", 'e', pid);
+    Report(s, EV_SERVED, pid, ch->id);
+
+    /* Release client */
+    Report(s, EV_LEFT, pid, ch->id);
+    Finish(&ch->visitor, VISIT_DONE);
+    TraceFlow('t', start, pid);
+    TraceSlice("release", start, pid);
+}
+
+/* One of the hairdressers the autoscaler started for the salon, NULL if pid is none of them */
+struct Spawned *SpawnedOf(struct Salon *s, pid_t pid)
+{
+    for (int i = 0; i < s->spawnedCount && pid != 0; i++)
+    {
+        if (s->spawned[i].pid == pid)
+            return &s->spawned[i];
+    }
+    return NULL;
+}
+
+/* Start n more hairdressers of one chair each */
+void Spawn(struct Salon *s, int n)
+{
+    char salon[16];
+    snprintf(salon, sizeof(salon), "%u", s->id);
+    for (int i = 0; i < n; i++)
+    {
+        if (s->spawnedCount == s->spawnedCap)
+        {
+            int cap = s->spawnedCap > 0 ? s->spawnedCap * 2 : 8;
+            struct Spawned *grown = realloc(s->spawned, cap * sizeof(*grown));
+            if (grown == NULL)
+                DieWithError("realloc() failed");
+            s->spawned = grown;
+            s->spawnedCap = cap;
+        }
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            /* Nothing of ours, sockets least of all, and no chatter in our log */
+            sigset_t none;
+            sigemptyset(&none);
+            sigprocmask(SIG_SETMASK, &none, NULL);
+            int null = open("/dev/null", O_WRONLY);
+            if (null >= 0)
+                dup2(null, STDOUT_FILENO);
+            close_range(STDERR_FILENO + 1, ~0u, 0);
+            execl(hairdresserPath, "hairdresser", "--salon", salon, hairdresserIP, hairdresserPort, (char *)NULL);
+            _exit(127);
+        }
+        if (pid < 0)
+        {
+            perror("Can't start a hairdresser");
+            return;
+        }
+        struct Spawned *sp = &s->spawned[s->spawnedCount++];
+        sp->pid = pid;
+        sp->registered = 0;
+        sp->retiring = 0;
+    }
+}
+
+/* Forget the hairdressers of ours that have exited */
+void Reap(struct Salon *s)
+{
+    int status;
+    for (int i = 0; i < s->spawnedCount; i++)
+    {
+        if (waitpid(s->spawned[i].pid, &status, WNOHANG) != s->spawned[i].pid)
+            continue;
+        if (!s->spawned[i].retiring)
+            printf("Autoscaler: hairdresser %d of salon %u exited by itself\n", s->spawned[i].pid, s->id);
+        s->spawned[i--] = s->spawned[--s->spawnedCount];
+    }
+}
+
+/* An idle hairdresser of ours that may go home, NULL if none is */
+struct Hairdresser *Retiree(struct Salon *s)
+{
+    for (int h = 0; h < s->hrdrCount; h++)
+    {
+        struct Hairdresser *hd = s->hrdrs[h];
+        if (hd->alive && hd->busy == 0 && SpawnedOf(s, hd->pid) != NULL)
+            return hd;
+    }
+    return NULL;
+}
+
+void Autoscale(struct Timer *t)
+{
+    struct Salon *s = (struct Salon *)((char *)t - offsetof(struct Salon, scale));
+    int target = targetWaitMs > 0 ? targetWaitMs : serviceMs;
+    int chairs = LiveChairs(s);
+    int wait = ExpectedWaitMs(s, chairs);
+    int running = 0;
+    int starting = 0;
+    struct Hairdresser *hd;
+
+    Reap(s);
+    for (int h = 0; h < s->hrdrCount; h++)
+    {
+        running += s->hrdrs[h]->alive;
+    }
+    for (int i = 0; i < s->spawnedCount; i++)
+    {
+        starting += !s->spawned[i].registered && !s->spawned[i].retiring;
+    }
+    running += starting;
+
+    if (running < scaleMin)
+    {
+        printf("Autoscaler: salon %u has %d hairdressers, below the minimum, starting %d (%d -> %d)\n", s->id,
+               running, scaleMin - running, running, scaleMin);
+        Spawn(s, scaleMin - running);
+        s->calmSince.tv_sec = s->calmSince.tv_nsec = 0;
+    }
+    else if ((wait > target || (wait < 0 && s->queueLen > 0)) && starting == 0 && running < scaleMax)
+    {
+        /* Chairs enough to bring the wait down to the target, each new one having one */
+        int needed = ((long)(s->queueLen - s->idleCount + 1) * serviceMs + target - 1) / target;
+        int n = needed - chairs;
+        if (n < 1)
+            n = 1;
+        if (n > scaleMax - running)
+            n = scaleMax - running;
+        printf("Autoscaler: salon %u expects a wait of %d ms with %d waiting, target %d ms, starting %d (%d -> %d)\n",
+               s->id, wait, s->queueLen, target, n, running, running + n);
+        Spawn(s, n);
+        s->calmSince.tv_sec = s->calmSince.tv_nsec = 0;
+    }
+    else if (wait >= 0 && wait <= target / 2)
+    {
+        if (s->calmSince.tv_sec == 0 && s->calmSince.tv_nsec == 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &s->calmSince);
+        }
+        else if (ElapsedMs(&s->calmSince) >= SCALE_COOLDOWN_MS && running > scaleMin && (hd = Retiree(s)) != NULL)
+        {
+            printf("Autoscaler: salon %u expects a wait of %d ms, under %d ms for %ld s, retiring hairdresser %d "
+                   "(%d -> %d)\n",
+                   s->id, wait, target / 2, ElapsedMs(&s->calmSince) / 1000, hd->pid, running, running - 1);
+            SpawnedOf(s, hd->pid)->retiring = 1;
+            kill(hd->pid, SIGTERM);
+            HairdresserRetired(hd);
+            clock_gettime(CLOCK_MONOTONIC, &s->calmSince); /* One per cooldown */
+        }
+    }
+    else
+    {
+        s->calmSince.tv_sec = s->calmSince.tv_nsec = 0;
+    }
+    TimerStart(&s->scale, SCALE_MS, Autoscale);
+}
+
+/* The salon with the id, opened on first use. NULL if there are too many */
+struct Salon *SalonOf(struct Shard *sh, uint32_t id)
+{
+    uint32_t slot = id * 2654435761u & (SALON_SLOTS - 1);
+    struct Salon *s;
+
+    while ((s = sh->salons[slot]) != NULL)
+    {
+        if (s->id == id)
+            return s;
+        slot = (slot + 1) & (SALON_SLOTS - 1);
+    }
+    if (atomic_fetch_add(&salonCount, 1) >= MAX_SALONS)
+    {
+        atomic_fetch_sub(&salonCount, 1);
+        return NULL;
+    }
+    if ((s = calloc(1, sizeof(*s))) == NULL)
+    {
+        DieWithError("calloc() failed");
+    }
+    s->id = id;
+    DayInit(&s->day);
+    s->next = sh->first;
+    sh->first = s;
+    sh->salons[slot] = s;
+    if (id != 0)
+    {
+        printf("Salon %u is open\n", id);
+    }
+    if (scaleMin >= 0)
+    {
+        TimerStart(&s->scale, 0, Autoscale);
+    }
+    return s;
+}
+
+/* Where our hairdressers find us: this binary's directory, and the hairdresser socket */
+void StartAutoscaler()
+{
+    ssize_t len = readlink("/proc/self/exe", hairdresserPath, sizeof(hairdresserPath) - 1);
+    char *slash;
+    if (len < 0)
+    {
+        DieWithError("Can't find the hairdresser binary");
+    }
+    hairdresserPath[len] = '\0';
+    if ((slash = strrchr(hairdresserPath, '/')) == NULL ||
+        (size_t)(slash - hairdresserPath) + sizeof("/hairdresser") > sizeof(hairdresserPath))
+    {
+        DieWithError("Can't find the hairdresser binary");
+    }
+    strcpy(slash, "/hairdresser");
+    if (servHrdr.kind == TRANSPORT_UNIX)
+    {
+        strcpy(hairdresserIP, "-");
+        snprintf(hairdresserPort, sizeof(hairdresserPort), "%s%s", UNIX_PREFIX,
+                 ((struct sockaddr_un *)&servHrdr.ep.addr)->sun_path);
+    }
+    else
+    {
+        struct sockaddr_in *in = (struct sockaddr_in *)&servHrdr.ep.addr;
+        struct in_addr any = {htonl(INADDR_LOOPBACK)};
+        inet_ntop(AF_INET, in->sin_addr.s_addr != INADDR_ANY ? &in->sin_addr : &any, hairdresserIP,
+                  sizeof(hairdresserIP));
+        snprintf(hairdresserPort, sizeof(hairdresserPort), "%d", ntohs(in->sin_port));
+    }
+    /* Salon 0 is always there; others get theirs once they open */
+    struct Wheel *own = wheel;
+    wheel = &shards[0].wheel;
+    SalonOf(&shards[0], 0);
+    wheel = own;
+}
+
+/* Hand a message to its salon, on the thread of its shard */
+void Deliver(struct Shard *sh, int kind, uint32_t salon, const void *msg, int len, const struct Peer *from)
+{
+    struct Transport *t = kind == INBOX_CLIENT ? &servClnt : &servHrdr;
+    struct Salon *s = SalonOf(sh, salon);
+
+    if (s == NULL)
+    {
+        printf("No room for salon %u\n", salon);
+        if (from->fd >= 0)
+            TransportHangup(t, from);
+        return;
+    }
+    if (kind == INBOX_CLIENT)
+        ClientMessage(s, msg, len, from);
+    else
+        HairdresserMessage(s, msg, len, from);
+}
+
+/* Which salon a message is for. A hangup is for the one its connection spoke for */
+uint32_t SalonIdOf(int kind, const void *msg, int len, const struct Peer *from)
+{
+    union Routed m;
+    uint32_t salon = 0;
+
+    if (len == 0)
+    {
+        return from->fd >= 0 && from->fd < connSalonLen ? connSalon[from->fd] : 0;
+    }
+    memcpy(&m, msg, len < (int)sizeof(m) ? len : (int)sizeof(m));
+    if (kind == INBOX_CLIENT && len == sizeof(m.req) && m.req.magic == REQUEST_MAGIC)
+        salon = m.req.salon;
+    else if (kind == INBOX_CLIENT && len == sizeof(m.group) && m.group.req.magic == REQUEST_MAGIC)
+        salon = m.group.req.salon;
+    else if (kind == INBOX_HRDR && len == sizeof(m.reg) && m.reg.magic == REGISTER_MAGIC)
+        salon = m.reg.salon;
+    else if (kind == INBOX_HRDR && len == sizeof(m.done))
+        salon = m.done.salon;
+    if (from->fd >= connSalonLen)
+    {
+        int grown = from->fd + 64;
+        if ((connSalon = realloc(connSalon, grown * sizeof(*connSalon))) == NULL)
+            DieWithError("realloc() failed");
+        memset(connSalon + connSalonLen, 0, (grown - connSalonLen) * sizeof(*connSalon));
+        connSalonLen = grown;
+    }
+    if (from->fd >= 0)
+    {
+        connSalon[from->fd] = salon;
+    }
+    return salon;
+}
+
+/* Pass the messages routed to a shard this round on to its worker */
+void FlushInbox(struct Shard *sh)
+{
+    if (sh->outCount == 0)
+    {
+        return;
+    }
+    /* Never wait for a busy shard: the pipe is non-blocking, like a full socket buffer */
+    if (write(sh->inbox[1], sh->out, sh->outCount * sizeof(struct Inbound)) < 0)
+    {
+        sh->dropped += sh->outCount;
+    }
+    sh->outCount = 0;
+}
+
+void FlushInboxes()
+{
+    for (int i = 0; i < workerCount; i++)
+    {
+        FlushInbox(&shards[i]);
+    }
+}
+
+/* Rate limiting (-r): a token bucket per client host, so that no host can
+   fill the queues. Main thread only. Buckets are kept in a pool found
+   through an open-addressing index, and once the pool is full the host
+   heard from least recently gives its bucket up to the newcomer */
+#define RATE_SOURCES 65536
+#define RATE_SLOTS (2 * RATE_SOURCES) /* The index is at most half full, so probes stay short */
+#define RATE_NONE 0xffffffffu
+
+struct Source
+{
+    uint32_t addr;  /* IPv4, network order */
+    uint32_t newer; /* Recency list, by index into sources, RATE_NONE at the ends */
+    uint32_t older;
+    int over;      /* Limited since it was last let in */
+    double tokens;
+    int64_t at;    /* When tokens was right, CLOCK_MONOTONIC ns */
+    unsigned long admitted;
+    unsigned long limited;
+};
+
+double rateLimit; /* Visits per second per host, 0 if unlimited */
+double rateBurst;
+struct Source *sources;
+uint32_t *sourceIndex; /* 1 + index into sources, 0 if the slot is empty */
+uint32_t sourceCount;
+uint32_t newestSource = RATE_NONE;
+uint32_t oldestSource = RATE_NONE;
+uint32_t sourceSeed; /* So that nobody can pick addresses that collide */
+unsigned long sourcesEvicted;
+atomic_ulong visitsLimited;
+
+static uint32_t sourceHome(uint32_t addr)
+{
+    uint32_t x = addr ^ sourceSeed;
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x & (RATE_SLOTS - 1);
+}
+
+/* The slot of the host, or the empty one where it would go */
+static uint32_t sourceSlot(uint32_t addr)
+{
+    uint32_t slot = sourceHome(addr);
+    while (sourceIndex[slot] != 0 && sources[sourceIndex[slot] - 1].addr != addr)
+    {
+        slot = (slot + 1) & (RATE_SLOTS - 1);
+    }
+    return slot;
+}
+
+static void unlinkSource(uint32_t i)
+{
+    struct Source *src = &sources[i];
+    if (src->newer != RATE_NONE)
+        sources[src->newer].older = src->older;
+    else
+        newestSource = src->older;
+    if (src->older != RATE_NONE)
+        sources[src->older].newer = src->newer;
+    else
+        oldestSource = src->newer;
+}
+
+static void pushSource(uint32_t i)
+{
+    sources[i].newer = RATE_NONE;
+    sources[i].older = newestSource;
+    if (newestSource != RATE_NONE)
+        sources[newestSource].newer = i;
+    else
+        oldestSource = i;
+    newestSource = i;
+}
+
+/* Take the host out of the index, shifting back whoever probed past it */
+static void dropSource(uint32_t i)
+{
+    uint32_t hole = sourceSlot(sources[i].addr);
+    sourceIndex[hole] = 0;
+    for (uint32_t j = (hole + 1) & (RATE_SLOTS - 1); sourceIndex[j] != 0; j = (j + 1) & (RATE_SLOTS - 1))
+    {
+        uint32_t home = sourceHome(sources[sourceIndex[j] - 1].addr);
+        /* Move j into the hole if the hole lies between its home and j */
+        if (((j - home) & (RATE_SLOTS - 1)) >= ((j - hole) & (RATE_SLOTS - 1)))
+        {
+            sourceIndex[hole] = sourceIndex[j];
+            sourceIndex[j] = 0;
+            hole = j;
+        }
+    }
+    unlinkSource(i);
+}
+
+/* The bucket of the host, made the most recent. New hosts start full */
+struct Source *SourceOf(uint32_t addr, int64_t now)
+{
+    uint32_t slot = sourceSlot(addr);
+    uint32_t i;
+
+    if (sourceIndex[slot] != 0)
+    {
+        i = sourceIndex[slot] - 1;
+        unlinkSource(i);
+        pushSource(i);
+        return &sources[i];
+    }
+    if (sourceCount == RATE_SOURCES)
+    {
+        i = oldestSource;
+        dropSource(i);
+        sourcesEvicted++;
+        slot = sourceSlot(addr);
+    }
+    else
+    {
+        i = sourceCount++;
+    }
+    memset(&sources[i], 0, sizeof(sources[i]));
+    sources[i].addr = addr;
+    sources[i].tokens = rateBurst;
+    sources[i].at = now;
+    sourceIndex[slot] = i + 1;
+    pushSource(i);
+    return &sources[i];
+}
+
+/* Turn away a new visit from a host over its limit. Returns 1 if it was */
+int RateLimited(const void *msg, int len, const struct Peer *from)
+{
+    struct ClientRequest req;
+    struct ClientStatus st;
+    struct Stamp now;
+    char name[64];
+
+    if (rateLimit <= 0 || from->fd >= 0 || from->addr.ss_family != AF_INET)
+    {
+        return 0;
+    }
+    /* Shorter than a magic is nothing we know, but the check below reads it */
+    memset(&req, 0, sizeof(req));
+    memcpy(&req, msg, len < (int)sizeof(req) ? len : (int)sizeof(req));
+    /* A party is one arrival */
+    if (len != sizeof(int) && (req.magic != REQUEST_MAGIC || !((len == sizeof(req) && req.type == REQ_VISIT) ||
+                                                               (len == sizeof(struct GroupRequest) && req.type == REQ_GROUP))))
+    {
+        return 0;
+    }
+    StampNow(&now, 0, STAMP_SYNCED);
+    struct Source *src = SourceOf(((const struct sockaddr_in *)&from->addr)->sin_addr.s_addr, now.mono);
+    src->tokens += (now.mono - src->at) * rateLimit / 1e9;
+    if (src->tokens > rateBurst)
+        src->tokens = rateBurst;
+    src->at = now.mono;
+    if (src->tokens >= 1)
+    {
+        src->tokens -= 1;
+        src->admitted++;
+        src->over = 0;
+        return 0;
+    }
+    src->limited++;
+    visitsLimited++;
+    if (!src->over)
+    {
+        src->over = 1;
+        printf("%s is over the limit\n", inet_ntop(AF_INET, &src->addr, name, sizeof(name)));
+    }
+    /* Old clients know no such answer, to them it's the same as a full queue */
+    if (len == sizeof(int))
+    {
+        SendTo(&servClnt, msg, sizeof(int), from, MSG_DONTWAIT);
+        return 1;
+    }
+    st.magic = REQUEST_MAGIC;
+    st.ticket = req.ticket;
+    st.status = VISIT_LIMITED;
+    st.sent = now;
+    SendTo(&servClnt, &st, sizeof(st), from, MSG_DONTWAIT);
+    return 1;
+}
+
+void StartRateLimit()
+{
+    struct timespec ts;
+    if ((sources = malloc(RATE_SOURCES * sizeof(*sources))) == NULL ||
+        (sourceIndex = calloc(RATE_SLOTS, sizeof(*sourceIndex))) == NULL)
+    {
+        DieWithError("malloc() failed");
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    sourceSeed = (uint32_t)ts.tv_nsec * 2654435761u ^ getpid();
+}
+
+/* Shutdown report: the hosts limited most */
+void PrintRateLimit()
+{
+    char name[64];
+    int shown[5];
+    int count = 0;
+
+    printf("Rate limit: %lu visits limited, %u hosts tracked, %lu forgotten\n", visitsLimited, sourceCount,
+           sourcesEvicted);
+    for (int k = 0; k < 5; k++)
+    {
+        int best = -1;
+        for (uint32_t i = 0; i < sourceCount; i++)
+        {
+            int taken = 0;
+            for (int j = 0; j < count; j++)
+                taken |= shown[j] == (int)i;
+            if (!taken && sources[i].limited > 0 && (best < 0 || sources[i].limited > sources[best].limited))
+                best = i;
+        }
+        if (best < 0)
+            break;
+        shown[count++] = best;
+        printf("%s: %lu let in, %lu limited\n", inet_ntop(AF_INET, &sources[best].addr, name, sizeof(name)),
+               sources[best].admitted, sources[best].limited);
+    }
+}
+
+/* Main thread: pass what came from a client or hairdresser to its salon */
+void Route(int kind, const void *msg, int len, const struct Peer *from)
+{
+    if (ClockSyncMessage(kind == INBOX_CLIENT ? &servClnt : &servHrdr, msg, len, from))
+    {
+        return;
+    }
+    if (kind == INBOX_CLIENT && RateLimited(msg, len, from))
+    {
+        return;
+    }
+    uint32_t salon = SalonIdOf(kind, msg, len, from);
+    struct Shard *sh = &shards[salon % shardCount];
+    if (workerCount == 0)
+    {
+        Deliver(sh, kind, salon, msg, len, from);
+        return;
+    }
+    if (len > (int)sizeof(sh->out[0].data))
+    {
+        return; /* Nothing a salon would take */
+    }
+    struct Inbound *m = &sh->out[sh->outCount++];
+    m->kind = kind;
+    m->len = len;
+    m->salon = salon;
+    m->from = *from;
+    memcpy(m->data, msg, len);
+    if (sh->outCount == INBOX_BATCH)
+    {
+        FlushInbox(sh);
+    }
+}
+
+/* Take everybody who came to the door into the queue */
+void HandleUDPClient()
+{
+    struct GroupRequest req; /* The largest a client sends */
+    struct Peer from;
+    int recvMsgSize; /* Size of received message */
+    while ((recvMsgSize = TransportRecv(&servClnt, &req, sizeof(req), &from, MSG_DONTWAIT)) >= 0)
+    {
+        Route(INBOX_CLIENT, &req, recvMsgSize, &from);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    {
+        DieWithError("recvfrom() from client failed");
+    }
+}
+
+/* Returns 0 if there was nothing to receive */
+int HandleHairdresser()
+{
+    struct JobDone msg; /* The largest it sends */
+    struct Peer from;
+    int recvMsgSize;
+
+    /* Receive notification about the end of the haircut */
+    if ((recvMsgSize = TransportRecv(&servHrdr, &msg, sizeof(msg), &from, MSG_DONTWAIT)) < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        DieWithError("recvfrom() from hairdresser failed");
+    }
+    Route(INBOX_HRDR, &msg, recvMsgSize, &from);
+    return 1;
+}
+
+/* Seat visitors in every salon of the shard that has free chairs */
+void DispatchShard(struct Shard *sh)
+{
+    for (struct Salon *s = sh->first; s != NULL; s = s->next)
+    {
+        Dispatch(s);
+        if (gossipOn)
+        {
+            int chairs = LiveChairs(s);
+            atomic_store_explicit(&s->waitMs, ExpectedWaitMs(s, chairs), memory_order_relaxed);
+            atomic_store_explicit(&s->shownQueueLen, s->queueLen, memory_order_relaxed);
+            atomic_store_explicit(&s->shownChairs, chairs, memory_order_relaxed);
+        }
+    }
+}
+
+/* Worker thread of a shard, with -w: the same as the main loop, fed from the inbox */
+void *RunShard(void *arg)
+{
+    struct Shard *sh = arg;
+    struct Inbound in[INBOX_BATCH];
+    struct pollfd fds[2];
+    ssize_t rdBytes;
+
+    wheel = &sh->wheel;
+    TraceThread("salons");
+    fds[0].fd = sh->inbox[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = sh->wheel.fd;
+    fds[1].events = POLLIN;
+    for (;;)
+    {
+        TimerRearm();
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+        {
+            DieWithError("poll() failed");
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            HandleTimers();
+        }
+        if ((fds[0].revents & POLLIN) && (rdBytes = read(sh->inbox[0], in, sizeof(in))) > 0)
+        {
+            /* Written whole, so only whole messages are read */
+            for (int i = 0; i < rdBytes / (int)sizeof(struct Inbound); i++)
+            {
+                if (in[i].kind == INBOX_PARK)
+                {
+                    /* Everything before it is done. The main thread hands the salons over */
+                    DispatchShard(sh);
+                    FlushReports();
+                    sem_post(&shardParked);
+                    for (;;)
+                    {
+                        pause();
+                    }
+                }
+                Deliver(sh, in[i].kind, in[i].salon, in[i].data, in[i].len, &in[i].from);
+            }
+        }
+        DispatchShard(sh);
+        FlushReports();
+    }
+}
+
+void StartShards()
+{
+    for (int i = 0; i < workerCount; i++)
+    {
+        struct Shard *sh = &shards[i];
+        if (pipe2(sh->inbox, O_CLOEXEC) < 0)
+        {
+            DieWithError("Can't open an inbox pipe");
+        }
+        /* Room for a burst while the worker is busy */
+        fcntl(sh->inbox[1], F_SETPIPE_SZ, 1 << 20);
+        fcntl(sh->inbox[1], F_SETFL, O_NONBLOCK);
+        pthread_create(&sh->thread, NULL, RunShard, sh);
+    }
+}
+
+/* Have every worker finish what is in its inbox and stop for good */
+void ParkShards()
+{
+    for (int i = 0; i < workerCount; i++)
+    {
+        FlushInbox(&shards[i]);
+        shards[i].out[0].kind = INBOX_PARK;
+        shards[i].outCount = 1;
+        /* This one must get there */
+        fcntl(shards[i].inbox[1], F_SETFL, 0);
+        FlushInbox(&shards[i]);
+    }
+    for (int i = 0; i < workerCount; i++)
+    {
+        while (sem_wait(&shardParked) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+/* Tell every peer server how long a newcomer would wait in our salons */
+void TellPeers()
+{
+    union
+    {
+        struct Gossip g;
+        char bytes[BATCH_BYTES];
+    } msg;
+    struct Gossip *g = &msg.g;
+
+    memset(g, 0, sizeof(*g));
+    g->magic = GOSSIP_MAGIC;
+    if (servClnt.kind == TRANSPORT_UDP)
+    {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)&servClnt.ep.addr;
+        g->addr = in->sin_addr.s_addr;
+        g->port = in->sin_port;
+    }
+    for (int i = 0; i < shardCount; i++)
+    {
+        for (struct Salon *s = shards[i].first; s != NULL && g->count < GOSSIP_SALONS; s = s->next)
+        {
+            struct GossipSalon *e = &g->salons[g->count++];
+            e->salon = s->id;
+            e->queueLen = atomic_load_explicit(&s->shownQueueLen, memory_order_relaxed);
+            e->chairs = atomic_load_explicit(&s->shownChairs, memory_order_relaxed);
+            e->waitMs = atomic_load_explicit(&s->waitMs, memory_order_relaxed);
+        }
+    }
+    for (int i = 0; i < peerServerCount; i++)
+    {
+        TransportSend(&servGossip, g, sizeof(*g) + g->count * sizeof(g->salons[0]), &peerServers[i].gossip,
+                      MSG_DONTWAIT);
+    }
+}
+
+/* News from a peer server. Only configured peers are listened to */
+void PeerHeard(const struct Gossip *g, int len, const struct Peer *from)
+{
+    if (len < (int)sizeof(*g) || g->magic != GOSSIP_MAGIC || g->count > GOSSIP_SALONS ||
+        len != (int)(sizeof(*g) + g->count * sizeof(g->salons[0])))
+    {
+        return;
+    }
+    for (int i = 0; i < peerServerCount; i++)
+    {
+        struct PeerServer *p = &peerServers[i];
+        if (!PeerEqual(&p->gossip, from))
+            continue;
+        pthread_mutex_lock(&peersLock);
+        if (p->heard.tv_sec == 0 && p->heard.tv_nsec == 0)
+            printf("Peer server %d is up\n", i);
+        clock_gettime(CLOCK_MONOTONIC, &p->heard);
+        memset(&p->clients, 0, sizeof(p->clients));
+        p->clients.sin_family = AF_INET;
+        /* A server bound to any address means the one it gossips from */
+        p->clients.sin_addr = ((const struct sockaddr_in *)&from->addr)->sin_addr;
+        if (g->addr != INADDR_ANY)
+            p->clients.sin_addr.s_addr = g->addr;
+        p->clients.sin_port = g->port;
+        p->count = g->count;
+        memcpy(p->salons, g->salons, g->count * sizeof(g->salons[0]));
+        pthread_mutex_unlock(&peersLock);
+        return;
+    }
+}
+
+void *Gossip()
+{
+    union
+    {
+        struct Gossip g;
+        char bytes[BATCH_BYTES];
+    } msg;
+    struct pollfd fd;
+    struct timespec told = {0, 0};
+    struct Peer from;
+    int len;
+
+    TraceThread("gossip");
+    fd.fd = servGossip.fd;
+    fd.events = POLLIN;
+    for (;;)
+    {
+        long due = GOSSIP_MS - ElapsedMs(&told);
+        if (due <= 0)
+        {
+            TellPeers();
+            clock_gettime(CLOCK_MONOTONIC, &told);
+            due = GOSSIP_MS;
+        }
+        if (poll(&fd, 1, due) <= 0)
+        {
+            continue;
+        }
+        while ((len = TransportRecv(&servGossip, &msg, sizeof(msg), &from, MSG_DONTWAIT)) >= 0)
+        {
+            PeerHeard(&msg.g, len, &from);
+        }
+    }
+    return NULL;
+}
+
+/* -p <ip>:<gossip port> */
+int AddPeerServer(const char *arg)
+{
+    struct Endpoint ep;
+    char ip[64];
+    const char *colon = strrchr(arg, ':');
+
+    if (colon == NULL || colon - arg >= (int)sizeof(ip) || peerServerCount == MAX_PEER_SERVERS)
+    {
+        return -1;
+    }
+    memcpy(ip, arg, colon - arg);
+    ip[colon - arg] = '\0';
+    if (ParseEndpoint(ip, colon + 1, &ep) < 0 || ep.kind != TRANSPORT_UDP)
+    {
+        return -1;
+    }
+    struct PeerServer *p = &peerServers[peerServerCount++];
+    p->gossip.fd = -1;
+    p->gossip.addr = ep.addr;
+    p->gossip.addrLen = ep.addrLen;
+    return 0;
+}
+
+void StartGossip()
+{
+    if (!gossipOn)
+    {
+        return;
+    }
+    pthread_mutex_init(&peersLock, NULL);
+    pthread_create(&gossipThread, NULL, Gossip, NULL);
+}
+
+struct Predicate CompileFilter(const struct ObserverFilter *f)
+{
+    struct Predicate p;
+    memset(&p, 0, sizeof(p));
+    p.events = f->events & (EV_ALL | FILTER_BINARY);
+    p.salon = f->salon;
+    p.hairdressers = f->hairdressers;
+    p.sampling = f->sampling;
+    if ((p.events & EV_ALL) == 0)
+        p.events |= EV_ALL;
+    if (p.hairdressers == 0)
+        p.hairdressers = ~(uint64_t)0;
+    if (p.sampling == 0 || p.sampling > SAMPLE_SCALE)
+        p.sampling = SAMPLE_SCALE;
+    return p;
+}
+
+int Matches(const struct Predicate *p, const struct SalonEvent *ev)
+{
+    int bit = ev->hairdresser < MAX_HAIRDRESSERS ? ev->hairdresser : MAX_HAIRDRESSERS - 1;
+    if (ev->salon != p->salon || !(p->events & EV_BIT(ev->type)) || !(p->hairdressers & ((uint64_t)1 << bit)))
+        return 0;
+    if (p->sampling == SAMPLE_SCALE || ev->pid == 0)
+        return 1;
+    /* Sample by visitor, so that a sampled visitor is reported from arrival to leaving */
+    uint32_t h = (uint32_t)ev->pid * 2654435761u;
+    return h % SAMPLE_SCALE < p->sampling;
+}
+
+/* Copy of the current table with observer add added and remove removed,
+   observers with equal predicates sharing a group: add keeps its own group
+   only if nobody has pred yet. Updaters only */
+struct ObserverTable *BuildTable(const struct ObserverTable *old, struct Observer *add, const struct Predicate *pred,
+                                 struct Observer *remove)
+{
+    struct Observer *all[MAX_OBSERVERS + 1];
+    int n = 0;
+    struct ObserverTable *t = calloc(1, sizeof(*t));
+    if (t == NULL)
+        return NULL;
+
+    for (int i = 0; i < old->count; i++)
+    {
+        if (old->obs[i] != remove)
+            all[n++] = old->obs[i];
+    }
+    if (add != NULL)
+    {
+        /* Join the group of an observer with the same filter, if there is one */
+        for (int i = 0; i < n; i++)
+        {
+            if (memcmp(&all[i]->group->pred, pred, sizeof(struct Predicate)) == 0)
+            {
+                add->group = all[i]->group;
+                break;
+            }
+        }
+        all[n++] = add;
+    }
+
+    /* Lay members out group by group */
+    for (int i = 0; i < n; i++)
+    {
+        int g;
+        for (g = 0; g < t->groupCount && t->groups[g] != all[i]->group; g++)
+            ;
+        if (g == t->groupCount)
+        {
+            t->groups[g] = all[i]->group;
+            t->groupCount++;
+        }
+        t->members[g]++;
+    }
+    for (int g = 1; g < t->groupCount; g++)
+    {
+        t->first[g] = t->first[g - 1] + t->members[g - 1];
+    }
+    int filled[MAX_OBSERVERS] = {0};
+    for (int i = 0; i < n; i++)
+    {
+        int g;
+        for (g = 0; t->groups[g] != all[i]->group; g++)
+            ;
+        t->obs[t->first[g] + filled[g]++] = all[i];
+    }
+    t->count = n;
+    return t;
+}
+
+/* Swap in a new version of the table, retire the old one. tableLock must be held */
+void PublishTable(struct ObserverTable *t)
+{
+    struct ObserverTable *old = atomic_exchange(&observerTable, t);
+    RcuRetire(old);
+    RcuReclaim();
+}
+
+/* Called once the writer can't be sending to the observer any more */
+void FreeObserver(void *p)
+{
+    struct Observer *o = p;
+    TransportHangup(&servObsrv, &o->peer);
+    free(o->out);
+    free(o);
+}
+
+/* Take an observer out of the table. tableLock must be held */
+void RemoveObserver(struct Observer *o)
+{
+    struct ObserverTable *old = atomic_load(&observerTable);
+    struct ObserverTable *t = BuildTable(old, NULL, NULL, o);
+    if (t != NULL)
+    {
+        int shared = 0;
+        for (int i = 0; i < t->count; i++)
+            shared |= t->obs[i]->group == o->group;
+        PublishTable(t);
+        if (!shared)
+            RcuRetire(o->group);
+        RcuCall(FreeObserver, o);
+    }
+}
+
+/* Called by the writer */
+void DropObserver(struct Observer *o, const char *why)
+{
+    o->gone = 1;
+    printf("Observer %d is %s, %lu messages dropped\n", o->id, why, o->dropped);
+    pthread_mutex_lock(&tableLock);
+    RemoveObserver(o);
+    pthread_mutex_unlock(&tableLock);
+}
+
+/* Ask the writer to wake up when fd is writable */
+int WatchWritable(int fd)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT;
+    ev.data.fd = fd;
+    if (epoll_ctl(writerEpoll, EPOLL_CTL_ADD, fd, &ev) < 0 && errno != EEXIST)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* Send what is queued for the observer */
+void DrainObserver(struct Observer *o)
+{
+    while (!o->gone && o->outLen > 0)
+    {
+        struct OutMsg *m = &o->out[o->outHead];
+        if (TransportSend(&servObsrv, m->data, m->len, &o->peer, MSG_DONTWAIT) != m->len)
+        {
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && WatchWritable(TransportSendFd(&servObsrv, &o->peer)) == 0)
+            {
+                return;
+            }
+            DropObserver(o, "absent");
+            return;
+        }
+        o->outHead = (o->outHead + 1) % outCap;
+        o->outLen--;
+    }
+}
+
+void SendToObserver(struct Observer *o, const void *msg, int len)
+{
+    if (o->gone)
+    {
+        return;
+    }
+    if (o->outLen == outCap)
+    {
+        o->dropped++;
+        if (dropPolicy == DROP_NEWEST)
+        {
+            return;
+        }
+        if (dropPolicy == DROP_DISCONNECT)
+        {
+            DropObserver(o, "too slow");
+            return;
+        }
+        o->outHead = (o->outHead + 1) % outCap;
+        o->outLen--;
+    }
+    struct OutMsg *m = &o->out[(o->outHead + o->outLen) % outCap];
+    memcpy(m->data, msg, len);
+    m->len = len;
+    o->outLen++;
+    if (o->outLen == 1)
+    {
+        DrainObserver(o);
+    }
+}
+
+void SendToGroup(const struct ObserverTable *t, int g, const void *msg, int len)
+{
+    for (int i = t->first[g]; i < t->first[g] + t->members[g]; ++i)
+    {
+        SendToObserver(t->obs[i], msg, len);
+    }
+}
+
+/* fd became writable: push queued messages of everybody who uses it */
+void HandleWritable(const struct ObserverTable *t, int fd)
+{
+    epoll_ctl(writerEpoll, EPOLL_CTL_DEL, fd, NULL);
+    for (int i = 0; i < t->count; ++i)
+    {
+        if (TransportSendFd(&servObsrv, &t->obs[i]->peer) == fd)
+        {
+            DrainObserver(t->obs[i]);
+        }
+    }
+}
+
+void FlushBatch(const struct ObserverTable *t, int g)
+{
+    char buffer[BATCH_BYTES];
+    struct EventBatch *batch = (struct EventBatch *)buffer;
+    struct FilterGroup *group = t->groups[g];
+    if (group->pending > 0)
+    {
+        batch->magic = BATCH_MAGIC;
+        batch->count = group->pending;
+        batch->first = group->covered + 1;
+        batch->last = group->events[group->pending - 1].seq;
+        memcpy(batch->events, group->events, batch->count * sizeof(struct SalonEvent));
+        SendToGroup(t, g, batch, sizeof(*batch) + batch->count * sizeof(struct SalonEvent));
+        group->covered = batch->last;
+        group->pending = 0;
+    }
+}
+
+/* How long epoll_wait() may sleep before the oldest pending batch is due */
+int BatchTimeout(const struct ObserverTable *t)
+{
+    int timeout = -1;
+    for (int g = 0; g < t->groupCount; ++g)
+    {
+        if (t->groups[g]->pending > 0)
+        {
+            long left = coalesceMs - ElapsedMs(&t->groups[g]->first);
+            if (left < 0)
+                left = 0;
+            if (timeout < 0 || left < timeout)
+                timeout = left;
+        }
+    }
+    return timeout;
+}
+
+/* State of the salon, made on first use. NULL if there are too many.
+   Observers may watch a salon nobody has come to yet */
+struct SalonState *StateOf(uint32_t salon)
+{
+    uint32_t slot = salon * 2654435761u & (2 * MAX_SALONS - 1);
+    struct SalonState *st;
+
+    while ((st = states[slot]) != NULL)
+    {
+        if (st->salon == salon)
+            return st;
+        slot = (slot + 1) & (2 * MAX_SALONS - 1);
+    }
+    if (stateCount == MAX_SALONS || (st = calloc(1, sizeof(*st))) == NULL)
+    {
+        return NULL;
+    }
+    st->salon = salon;
+    st->historyFrom = 1;
+    for (int c = 0; c < MAX_HAIRDRESSERS; c++)
+    {
+        st->chairs[c] = -1;
+    }
+    states[slot] = st;
+    stateCount++;
+    return st;
+}
+
+static struct Waiting **pidBucket(struct SalonState *st, pid_t pid)
+{
+    return &st->buckets[(uint32_t)pid * 2654435761u & (st->bucketCount - 1)];
+}
+
+static void chainWaiting(struct SalonState *st, struct Waiting *w)
+{
+    struct Waiting **b = pidBucket(st, w->pid);
+    w->chain = *b;
+    *b = w;
+}
+
+/* One more waiting visitor, arrived now: at the back of the queue, or at
+   the front for one a hairdresser let down */
+struct Waiting *AddWaiting(struct SalonState *st, pid_t pid, int front)
+{
+    struct Waiting *w;
+
+    if (st->waitingLen >= st->bucketCount)
+    {
+        int count = st->bucketCount > 0 ? st->bucketCount * 2 : 16;
+        free(st->buckets);
+        if ((st->buckets = calloc(count, sizeof(*st->buckets))) == NULL)
+            DieWithError("calloc() failed");
+        st->bucketCount = count;
+        for (w = st->head; w != NULL; w = w->next)
+            chainWaiting(st, w);
+    }
+    if ((w = st->spare) != NULL)
+        st->spare = w->chain;
+    else if ((w = malloc(sizeof(*w))) == NULL)
+        DieWithError("malloc() failed");
+    w->pid = pid;
+    clock_gettime(CLOCK_MONOTONIC, &w->arrived);
+    chainWaiting(st, w);
+    if (front)
+    {
+        w->order = st->head != NULL ? st->head->order - 1 : 0;
+        w->prev = NULL;
+        w->next = st->head;
+        if (st->head != NULL)
+            st->head->prev = w;
+        else
+            st->tail = w;
+        st->head = w;
+    }
+    else
+    {
+        w->order = st->tail != NULL ? st->tail->order + 1 : 0;
+        w->prev = st->tail;
+        w->next = NULL;
+        if (st->tail != NULL)
+            st->tail->next = w;
+        else
+            st->head = w;
+        st->tail = w;
+    }
+    st->waitingLen++;
+    return w;
+}
+
+/* The visitor leaves the queue. A pid may wait more than once, the oldest goes */
+void Unwait(struct SalonState *st, pid_t pid)
+{
+    struct Waiting **oldest = NULL;
+    struct Waiting *w;
+
+    if (st->bucketCount == 0)
+    {
+        return;
+    }
+    for (struct Waiting **b = pidBucket(st, pid); *b != NULL; b = &(*b)->chain)
+    {
+        if ((*b)->pid == pid && (oldest == NULL || (*b)->order < (*oldest)->order))
+            oldest = b;
+    }
+    if (oldest == NULL)
+    {
+        return;
+    }
+    w = *oldest;
+    *oldest = w->chain;
+    if (w->prev != NULL)
+        w->prev->next = w->next;
+    else
+        st->head = w->next;
+    if (w->next != NULL)
+        w->next->prev = w->prev;
+    else
+        st->tail = w->prev;
+    w->chain = st->spare;
+    st->spare = w;
+    st->waitingLen--;
+}
+
+/* Snapshots only show the first chairs */
+void SetChair(struct SalonState *st, const struct SalonEvent *ev, pid_t pid)
+{
+    if (ev->hairdresser < MAX_HAIRDRESSERS)
+        st->chairs[ev->hairdresser] = pid;
+}
+
+void ApplyEvent(struct SalonEvent *ev)
+{
+    struct SalonState *st = StateOf(ev->salon);
+    if (st == NULL)
+    {
+        return;
+    }
+    ev->seq = ++st->seq;
+    if (st->history == NULL && (st->history = malloc(historyLen * sizeof(struct SalonEvent))) == NULL)
+    {
+        DieWithError("malloc() failed");
+    }
+    st->history[ev->seq % historyLen] = *ev;
+    st->counts[ev->type]++;
+    switch (ev->type)
+    {
+    case EV_OPEN:
+        SetChair(st, ev, 0);
+        break;
+    case EV_QUEUED:
+        AddWaiting(st, ev->pid, 0);
+        break;
+    case EV_DISPATCHED:
+        /* Almost always the first one */
+        Unwait(st, ev->pid);
+        SetChair(st, ev, ev->pid);
+        break;
+    case EV_SERVED:
+        SetChair(st, ev, 0);
+        break;
+    case EV_LEFT:
+        /* Still waiting only if a hairdresser given up on finished late */
+    case EV_ABANDONED:
+        Unwait(st, ev->pid);
+        break;
+    case EV_LOST:
+        SetChair(st, ev, -1);
+        if (ev->pid != 0)
+            AddWaiting(st, ev->pid, 1);
+        break;
+    case EV_CLOSED:
+        SetChair(st, ev, -1);
+        break;
+    }
+}
+
+void SendSnapshot(struct Observer *o)
+{
+    char buffer[BATCH_BYTES];
+    struct SalonSnapshot *snap = (struct SalonSnapshot *)buffer;
+    struct SalonState *st = StateOf(o->group->pred.salon);
+    struct Waiting *w;
+    int first = 0;
+
+    if (st == NULL)
+    {
+        return;
+    }
+    snap->magic = SNAPSHOT_MAGIC;
+    snap->seq = st->seq;
+    snap->timeMs = ElapsedMs(&startTime);
+    memcpy(snap->counts, st->counts, sizeof(snap->counts));
+    memcpy(snap->chairs, st->chairs, sizeof(snap->chairs));
+    snap->queueLen = st->waitingLen;
+    w = st->head;
+    do
+    {
+        snap->first = first;
+        snap->count = 0;
+        for (; w != NULL && snap->count < SNAPSHOT_VISITORS; w = w->next)
+        {
+            snap->waiting[snap->count].pid = w->pid;
+            snap->waiting[snap->count].waitedMs = ElapsedMs(&w->arrived);
+            snap->count++;
+            first++;
+        }
+        SendToObserver(o, snap, sizeof(*snap) + snap->count * sizeof(struct WaitingVisitor));
+    } while (w != NULL);
+}
+
+/* Events first .. last again, for an observer that missed them: whatever its
+   filter matches, in batches that cover the range. If the oldest are no
+   longer kept it gets RESYNC and a new snapshot, and starts over */
+void Resend(struct Observer *o, uint32_t first, uint32_t last)
+{
+    char buffer[BATCH_BYTES];
+    struct EventBatch *batch = (struct EventBatch *)buffer;
+    struct SalonState *st = StateOf(o->group->pred.salon);
+
+    if (st == NULL)
+    {
+        return;
+    }
+    /* Later ones are still on their way */
+    if (last > o->group->covered)
+        last = o->group->covered;
+    if (first > last)
+    {
+        return;
+    }
+    uint32_t oldest = st->seq >= (uint32_t)historyLen ? st->seq - historyLen + 1 : 1;
+    if (oldest < st->historyFrom)
+        oldest = st->historyFrom;
+    if (first < oldest)
+    {
+        struct ObserverResync resync = {RESYNC_MAGIC, oldest};
+        printf("Observer %d missed events %u .. %u, too old, resync\n", o->id, first, last);
+        SendToObserver(o, &resync, sizeof(resync));
+        SendSnapshot(o);
+        return;
+    }
+
+    batch->magic = BATCH_MAGIC;
+    batch->count = 0;
+    batch->first = first;
+    for (uint32_t seq = first; seq <= last; seq++)
+    {
+        const struct SalonEvent *ev = &st->history[seq % historyLen];
+        if (Matches(&o->group->pred, ev))
+            batch->events[batch->count++] = *ev;
+        if (batch->count == BATCH_EVENTS || seq == last)
+        {
+            batch->last = seq;
+            SendToObserver(o, batch, sizeof(*batch) + batch->count * sizeof(struct SalonEvent));
+            batch->first = seq + 1;
+            batch->count = 0;
+        }
+    }
+}
+
+/* Answer the NACKs AcceptObserver() has queued */
+void AnswerNacks(const struct ObserverTable *t)
+{
+    struct PendingNack pending[MAX_NACKS];
+    int count;
+
+    pthread_mutex_lock(&nackLock);
+    count = nackCount;
+    memcpy(pending, nacks, count * sizeof(struct PendingNack));
+    nackCount = 0;
+    pthread_mutex_unlock(&nackLock);
+
+    for (int n = 0; n < count; n++)
+    {
+        for (int i = 0; i < t->count; ++i)
+        {
+            if (t->obs[i]->introduced && PeerEqual(&t->obs[i]->peer, &pending[n].peer))
+            {
+                Resend(t->obs[i], pending[n].first, pending[n].last);
+                break;
+            }
+        }
+    }
+}
+
+/* Apply an event and send it to every group it matches */
+void FanOut(const struct ObserverTable *t, struct SalonEvent *ev)
+{
+    char str[150];
+    int len = -1;
+
+    ApplyEvent(ev);
+    for (int g = 0; g < t->groupCount; ++g)
+    {
+        struct FilterGroup *group = t->groups[g];
+        if (!Matches(&group->pred, ev))
+        {
+            continue;
+        }
+        if (coalesceMs == 0 && !(group->pred.events & FILTER_BINARY))
+        {
+            if (len < 0)
+                len = FormatEvent(ev, str);
+            SendToGroup(t, g, str, len);
+            continue;
+        }
+        if (group->pending == 0)
+            clock_gettime(CLOCK_MONOTONIC, &group->first);
+        group->events[group->pending++] = *ev;
+        if (group->pending == BATCH_EVENTS || coalesceMs == 0)
+            FlushBatch(t, g);
+    }
+}
+
+/* Send everything the writer holds and stop for good. The main thread
+   hands over the state once writerParked is posted */
+void ParkWriter(const struct ObserverTable *t)
+{
+    struct SalonEvent ev;
+
+    while (read(info_pipe[0], &ev, sizeof(ev)) == sizeof(ev))
+    {
+        FanOut(t, &ev);
+    }
+    for (int g = 0; g < t->groupCount; ++g)
+    {
+        FlushBatch(t, g);
+    }
+    for (int i = 0; i < t->count; ++i)
+    {
+        DrainObserver(t->obs[i]);
+    }
+    sem_post(&writerParked);
+    for (;;)
+    {
+        pause();
+    }
+}
+
+void *WriteInfo()
+{
+    struct SalonEvent evs[REPORT_BATCH];
+    ssize_t rdBytes;
+    struct epoll_event ready[16];
+    int nready;
+    uint64_t wakes;
+    struct ObserverTable *t;
+    int reader = RcuRegisterReader();
+    TraceThread("writer");
+    for (;;)
+    {
+        /* Nothing from the previous round is referenced past this point */
+        RcuQuiescent(reader);
+        t = atomic_load(&observerTable);
+        nready = epoll_wait(writerEpoll, ready, 16, BatchTimeout(t));
+        RcuQuiescent(reader);
+        t = atomic_load(&observerTable);
+        if (pthread_mutex_trylock(&tableLock) == 0)
+        {
+            /* Close and free what the last round was still able to see */
+            RcuReclaim();
+            pthread_mutex_unlock(&tableLock);
+        }
+
+        /* Newcomers get the state folded from every event applied so far.
+           Batched events they see again are skipped by their sequence number */
+        for (int i = 0; i < t->count; ++i)
+        {
+            struct Observer *o = t->obs[i];
+            if (!o->introduced)
+            {
+                o->introduced = 1;
+                if (!o->group->started)
+                {
+                    /* A new group: its batches start right after the snapshot */
+                    struct SalonState *st = StateOf(o->group->pred.salon);
+                    o->group->started = 1;
+                    o->group->covered = st != NULL ? st->seq : 0;
+                }
+                SendSnapshot(o);
+            }
+        }
+        AnswerNacks(t);
+
+        for (int r = 0; r < nready; r++)
+        {
+            if (ready[r].data.fd == writerWake)
+            {
+                read(writerWake, &wakes, sizeof(wakes));
+            }
+            else if (ready[r].data.fd != info_pipe[0])
+            {
+                HandleWritable(t, ready[r].data.fd);
+            }
+            else if ((rdBytes = read(info_pipe[0], evs, sizeof(evs))) < 0 && errno != EAGAIN)
+            {
+                DieWithError("Can't read from pipe");
+            }
+            else
+            {
+                /* Reports are written whole, so only whole events are read */
+                uint64_t start = TraceNow();
+                for (int e = 0; e < rdBytes / (int)sizeof(struct SalonEvent); e++)
+                    FanOut(t, &evs[e]);
+                TraceSlice("fan out", start, 0);
+            }
+        }
+        for (int g = 0; g < t->groupCount; ++g)
+        {
+            struct FilterGroup *group = t->groups[g];
+            if (coalesceMs > 0 && group->pending > 0 && ElapsedMs(&group->first) >= coalesceMs)
+            {
+                FlushBatch(t, g);
+            }
+        }
+        if (atomic_load(&handoffRequested))
+        {
+            ParkWriter(t);
+        }
+    }
+}
+
+void *AcceptObserver()
+{
+    struct Peer obsrvPeer;
+    int recvMsgSize;
+    struct ObserverFilter filter;
+    struct ObserverNack *nack = (struct ObserverNack *)&filter;
+    uint64_t wake = 1;
+    struct pollfd fds[2];
+    fds[0].fd = TransportPollFd(&servObsrv);
+    fds[0].events = POLLIN;
+    fds[1].fd = acceptStop;
+    fds[1].events = POLLIN;
+    for (;;)
+    {
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+        {
+            DieWithError("poll() failed");
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            /* Handing over, the observers go with the table */
+            return NULL;
+        }
+        memset(&filter, 0, sizeof(filter));
+        if ((recvMsgSize = TransportRecv(&servObsrv, &filter, sizeof(filter), &obsrvPeer, MSG_DONTWAIT)) < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                continue;
+            DieWithError("recvfrom() failed");
+        }
+        if (recvMsgSize == 0)
+        {
+            /* Hung up, unless it is an empty datagram */
+            if (obsrvPeer.fd < 0)
+                continue;
+            pthread_mutex_lock(&tableLock);
+            struct ObserverTable *t = atomic_load(&observerTable);
+            for (int i = 0; i < t->count; i++)
+            {
+                if (PeerEqual(&t->obs[i]->peer, &obsrvPeer))
+                {
+                    printf("Observer %d left\n", t->obs[i]->id);
+                    RemoveObserver(t->obs[i]);
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&tableLock);
+            continue;
+        }
+        if (recvMsgSize == sizeof(*nack) && nack->magic == NACK_MAGIC)
+        {
+            /* A registered observer missed some events. If the queue is full it will ask again */
+            pthread_mutex_lock(&nackLock);
+            if (nackCount < MAX_NACKS)
+            {
+                nacks[nackCount].peer = obsrvPeer;
+                nacks[nackCount].first = nack->first;
+                nacks[nackCount].last = nack->last;
+                nackCount++;
+            }
+            pthread_mutex_unlock(&nackLock);
+            write(writerWake, &wake, sizeof(wake));
+            continue;
+        }
+        if (recvMsgSize < (int)sizeof(filter))
+        {
+            /* Old observer without a filter */
+            memset(&filter, 0, sizeof(filter));
+        }
+
+        struct Observer *o = calloc(1, sizeof(*o));
+        struct FilterGroup *group = calloc(1, sizeof(*group));
+        if (o == NULL || group == NULL || (o->out = malloc(outCap * sizeof(struct OutMsg))) == NULL)
+        {
+            DieWithError("malloc() failed");
+        }
+        group->pred = CompileFilter(&filter);
+        o->peer = obsrvPeer;
+        o->group = group;
+
+        pthread_mutex_lock(&tableLock);
+        struct ObserverTable *old = atomic_load(&observerTable);
+        struct ObserverTable *t = old->count < MAX_OBSERVERS ? BuildTable(old, o, &group->pred, NULL) : NULL;
+        if (t != NULL)
+        {
+            o->id = nextObserverId++;
+            printf("Set observer %d\n", o->id);
+            PublishTable(t);
+        }
+        pthread_mutex_unlock(&tableLock);
+
+        if (t == NULL)
+        {
+            printf("No room for another observer\n");
+            TransportHangup(&servObsrv, &obsrvPeer);
+            free(o->out);
+            free(o);
+            free(group);
+            continue;
+        }
+        if (o->group != group)
+        {
+            /* Joined an existing group */
+            free(group);
+        }
+        /* Let the writer send the snapshot */
+        write(writerWake, &wake, sizeof(wake));
+    }
+}
+
+void setObservers()
+{
+    /* A server which took over already has its observers */
+    if (observerTable == NULL && (observerTable = calloc(1, sizeof(struct ObserverTable))) == NULL)
+    {
+        DieWithError("malloc() failed");
+    }
+    if ((acceptStop = eventfd(0, EFD_NONBLOCK)) < 0)
+    {
+        DieWithError("eventfd() failed");
+    }
+
+    pthread_create(&acceptThread, NULL, AcceptObserver, NULL);
+}
+
+void StartWriter()
+{
+    if (pipe(info_pipe) < 0)
+    {
+        DieWithError("Can\'t open the info pipe\n");
+    }
+    /* Room for a burst of events while the writer is busy */
+    fcntl(info_pipe[1], F_SETPIPE_SZ, 1 << 20);
+    fcntl(info_pipe[1], F_SETFL, O_NONBLOCK);
+    /* So that the writer can drain it before a handoff */
+    fcntl(info_pipe[0], F_SETFL, O_NONBLOCK);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = info_pipe[0];
+    if ((writerEpoll = epoll_create1(0)) < 0 || epoll_ctl(writerEpoll, EPOLL_CTL_ADD, info_pipe[0], &ev) < 0)
+    {
+        DieWithError("Can\'t watch the info pipe\n");
+    }
+    ev.data.fd = writerWake;
+    if (epoll_ctl(writerEpoll, EPOLL_CTL_ADD, writerWake, &ev) < 0)
+    {
+        DieWithError("Can\'t watch the info pipe\n");
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, WriteInfo, NULL);
+}
+
+/* Sent over the handoff connection: a header with the listening sockets,
+   then every salon: a header of its own and one record per live hairdresser,
+   busy chair and waiting visitor, and last one record per observer.
+   Records carry their connection if they have one */
+#define HANDOFF_MAGIC 0x484e4c53 /* "SLNH" */
+
+struct HandoffHeader
+{
+    uint32_t magic;
+    struct Endpoint eps[4]; /* Clients, hairdresser, observers, and gossip if there is */
+    int gossip;
+    int salons;
+    int observers;
+    int nextObserverId;
+    uint32_t uptimeMs;
+    unsigned long visitsLimited;
+    int connections[3]; /* Of clients, hairdressers and observers, sent last */
+};
+
+struct HandoffSalon
+{
+    uint32_t id;
+    int hairdressers;
+    int busyChairs;
+    int queueLen;
+    uint32_t seq;
+    uint32_t counts[EV_TYPES];
+    pid_t chairs[MAX_HAIRDRESSERS];
+
+    /* The day so far, for the report */
+    unsigned long visits;
+    unsigned long served;
+    unsigned long turnedAway;
+    unsigned long abandoned;
+    unsigned long redirected;
+    struct DayStats day; /* Its lock is not sent */
+    struct Histogram hops[HOPS];
+};
+
+struct HandoffRecord
+{
+    struct Visitor visitor; /* Visitors and busy chairs */
+    uint32_t waitedMs;      /* Visitors only */
+    int64_t seated;         /* Busy chairs only */
+    struct Peer peer;       /* Observers and hairdressers */
+    int id;                 /* Observer id, first chair of a hairdresser, or the busy chair */
+    int chairs;             /* Hairdressers only */
+    struct Predicate pred;  /* Observers only */
+};
+
+/* now minus ms */
+void BackDate(struct timespec *ts, long ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec -= ms / 1000;
+    ts->tv_nsec -= (ms % 1000) * 1000000;
+    if (ts->tv_nsec < 0)
+    {
+        ts->tv_sec--;
+        ts->tv_nsec += 1000000000;
+    }
+}
+
+void SendHandoff(int conn, const void *msg, size_t len, const struct Peer *peer)
+{
+    int n = peer->fd >= 0 ? 1 : 0;
+    if (SendWithFds(conn, msg, len, &peer->fd, n) != (ssize_t)len)
+    {
+        DieWithError("sendmsg() to the new server failed");
+    }
+}
+
+void HandOverSalon(int conn, struct Salon *s)
+{
+    struct HandoffSalon hs;
+    struct HandoffRecord r;
+    struct SalonState *st = StateOf(s->id);
+
+    memset(&hs, 0, sizeof(hs));
+    hs.id = s->id;
+    for (int i = 0; i < s->hrdrCount; i++)
+        hs.hairdressers += s->hrdrs[i]->alive;
+    for (int c = 0; c < MAX_CHAIRS; c++)
+        hs.busyChairs += s->chairs[c] != NULL && s->chairs[c]->busy;
+    hs.queueLen = s->queueLen;
+    if (st != NULL)
+    {
+        hs.seq = st->seq;
+        memcpy(hs.counts, st->counts, sizeof(hs.counts));
+        memcpy(hs.chairs, st->chairs, sizeof(hs.chairs));
+    }
+    hs.visits = atomic_load(&s->visits);
+    hs.served = atomic_load(&s->served);
+    hs.turnedAway = atomic_load(&s->turnedAway);
+    hs.abandoned = atomic_load(&s->abandoned);
+    hs.redirected = atomic_load(&s->redirected);
+    pthread_mutex_lock(&s->day.lock);
+    /* Chair time up to now, the new server counts on from its own */
+    DayChairs(&s->day, 0, TraceNow());
+    DayCopy(&hs.day, &s->day);
+    pthread_mutex_unlock(&s->day.lock);
+    memcpy(hs.hops, s->hops, sizeof(hs.hops));
+    if (SendWithFds(conn, &hs, sizeof(hs), NULL, 0) != sizeof(hs))
+    {
+        DieWithError("sendmsg() to the new server failed");
+    }
+
+    for (int i = 0; i < s->hrdrCount; i++)
+    {
+        if (!s->hrdrs[i]->alive)
+            continue;
+        memset(&r, 0, sizeof(r));
+        r.peer = s->hrdrs[i]->peer;
+        r.id = s->hrdrs[i]->firstChair;
+        r.chairs = s->hrdrs[i]->chairs;
+        SendHandoff(conn, &r, sizeof(r), &r.peer);
+    }
+    for (int c = 0; c < MAX_CHAIRS; c++)
+    {
+        if (s->chairs[c] == NULL || !s->chairs[c]->busy)
+            continue;
+        memset(&r, 0, sizeof(r));
+        r.visitor = s->chairs[c]->visitor;
+        r.seated = s->chairs[c]->seated;
+        r.id = c;
+        if (r.visitor.detached)
+            r.visitor.peer.fd = -1; /* Already closed */
+        SendHandoff(conn, &r, sizeof(r), &r.visitor.peer);
+    }
+    struct Waiting *seen = st != NULL ? st->head : NULL;
+    for (struct Waiter *w = s->head; w != NULL; w = w->next)
+    {
+        memset(&r, 0, sizeof(r));
+        r.visitor = w->v;
+        /* The writer has applied every event, so its list is the same queue */
+        if (seen != NULL && seen->pid == r.visitor.pid)
+            r.waitedMs = ElapsedMs(&seen->arrived);
+        if (seen != NULL)
+            seen = seen->next;
+        SendHandoff(conn, &r, sizeof(r), &r.visitor.peer);
+    }
+}
+
+/* Workers finish with what came so far and stop. Then observers stop
+   registering, and the writer sends what it has and parks. After that
+   the main thread is the only one left touching the salons */
+void ParkAll()
+{
+    uint64_t one = 1;
+
+    ParkShards();
+    FlushReports();
+    write(acceptStop, &one, sizeof(one));
+    pthread_join(acceptThread, NULL);
+    atomic_store(&handoffRequested, 1);
+    write(writerWake, &one, sizeof(one));
+    while (sem_wait(&writerParked) < 0 && errno == EINTR)
+        ;
+}
+
+/* A new server connected to the handoff socket: give it everything and exit.
+   Nothing is closed or unlinked, the sockets live on in the new process */
+void HandOver()
+{
+    int conn;
+    struct HandoffHeader h;
+    struct HandoffRecord r;
+    int fds[4];
+    int nfds = 0;
+    int waiting = 0;
+
+    if ((conn = accept4(servHandoff.fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+    {
+        return;
+    }
+    printf("Handing over to the new server\n");
+
+    /* Whoever already knocked is handed over too, every haircut that is done first */
+    while (HandleHairdresser())
+        ;
+    HandleUDPClient();
+
+    ParkAll();
+    struct ObserverTable *t = atomic_load(&observerTable);
+
+    memset(&h, 0, sizeof(h));
+    h.magic = HANDOFF_MAGIC;
+    h.eps[0] = servClnt.ep;
+    h.eps[1] = servHrdr.ep;
+    h.eps[2] = servObsrv.ep;
+    fds[nfds++] = servClnt.fd;
+    fds[nfds++] = servHrdr.fd;
+    fds[nfds++] = servObsrv.fd;
+    if (gossipOn)
+    {
+        h.gossip = 1;
+        h.eps[3] = servGossip.ep;
+        fds[nfds++] = servGossip.fd;
+    }
+    h.salons = atomic_load(&salonCount);
+    h.observers = 0;
+    for (int i = 0; i < t->count; i++)
+        h.observers += !t->obs[i]->gone;
+    h.nextObserverId = nextObserverId;
+    h.uptimeMs = ElapsedMs(&startTime);
+    h.visitsLimited = atomic_load(&visitsLimited);
+    /* Connections with nothing going on, like a client between visits, live on too */
+    int *conns[3];
+    struct Transport *ts[3] = {&servClnt, &servHrdr, &servObsrv};
+    for (int k = 0; k < 3; k++)
+    {
+        if ((h.connections[k] = TransportConnections(ts[k], &conns[k])) < 0)
+            DieWithError("malloc() failed");
+    }
+    if (SendWithFds(conn, &h, sizeof(h), fds, nfds) != sizeof(h))
+    {
+        DieWithError("sendmsg() to the new server failed");
+    }
+
+    for (int i = 0; i < shardCount; i++)
+    {
+        for (struct Salon *s = shards[i].first; s != NULL; s = s->next)
+        {
+            HandOverSalon(conn, s);
+            waiting += s->queueLen;
+        }
+    }
+    for (int i = 0; i < t->count; i++)
+    {
+        if (t->obs[i]->gone)
+            continue;
+        memset(&r, 0, sizeof(r));
+        r.peer = t->obs[i]->peer;
+        r.id = t->obs[i]->id;
+        r.pred = t->obs[i]->group->pred;
+        SendHandoff(conn, &r, sizeof(r), &r.peer);
+    }
+    for (int k = 0; k < 3; k++)
+    {
+        for (int i = 0; i < h.connections[k]; i++)
+        {
+            memset(&r, 0, sizeof(r));
+            r.peer.fd = conns[k][i];
+            SendHandoff(conn, &r, sizeof(r), &r.peer);
+        }
+    }
+
+    printf("Handed over %d waiting in %d salons and %d observers\n", waiting, h.salons, h.observers);
+    close(conn);
+    exit(0);
+}
+
+/* Receive the next handoff message, its descriptor replacing the stale peer->fd */
+void RecvHandoff(int conn, void *msg, size_t len, int *fds, int room)
+{
+    int nfds = room;
+    if (RecvWithFds(conn, msg, len, fds, &nfds) != (ssize_t)len)
+    {
+        DieWithError("recvmsg() from the old server failed");
+    }
+    for (int i = nfds; i < room; i++)
+    {
+        fds[i] = -1;
+    }
+}
+
+/* Connections already adopted, by their number in the old server.
+   A client with several visits arrives once per visit */
+struct AdoptedFd
+{
+    int old;
+    int fd;
+} *adopted;
+int adoptedLen;
+
+void AdoptPeer(struct Transport *t, struct Peer *p, int fd)
+{
+    if (p->fd < 0)
+    {
+        return;
+    }
+    for (int i = 0; i < adoptedLen; i++)
+    {
+        if (adopted[i].old == p->fd)
+        {
+            close(fd);
+            p->fd = adopted[i].fd;
+            return;
+        }
+    }
+    if ((adopted = realloc(adopted, (adoptedLen + 1) * sizeof(*adopted))) == NULL)
+    {
+        DieWithError("realloc() failed");
+    }
+    adopted[adoptedLen].old = p->fd;
+    if ((p->fd = fd) < 0 || TransportAdoptPeer(t, p) < 0)
+    {
+        DieWithError("Can't adopt a connection");
+    }
+    adopted[adoptedLen++].fd = fd;
+}
+
+/* Parties already rebuilt, by their address in the old server */
+struct AdoptedParty
+{
+    struct Party *old;
+    struct Party *party;
+} *adoptedParties;
+int adoptedPartyLen;
+
+/* The visitor's party here: counts only the members handed over, the others are done */
+void AdoptParty(struct Visitor *v)
+{
+    if (v->party == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < adoptedPartyLen; i++)
+    {
+        if (adoptedParties[i].old == v->party)
+        {
+            v->party = adoptedParties[i].party;
+            v->party->left++;
+            return;
+        }
+    }
+    if ((adoptedParties = realloc(adoptedParties, (adoptedPartyLen + 1) * sizeof(*adoptedParties))) == NULL)
+    {
+        DieWithError("realloc() failed");
+    }
+    adoptedParties[adoptedPartyLen].old = v->party;
+    if ((v->party = calloc(1, sizeof(*v->party))) == NULL)
+    {
+        DieWithError("calloc() failed");
+    }
+    v->party->left = 1;
+    adoptedParties[adoptedPartyLen++].party = v->party;
+}
+
+/* The next salon of a handoff, into the shard it belongs to here. Returns its queue length */
+int TakeOverSalon(int conn)
+{
+    struct HandoffSalon hs;
+    struct HandoffRecord r;
+    int fds[1];
+
+    RecvHandoff(conn, &hs, sizeof(hs), fds, 0);
+    struct Shard *sh = &shards[hs.id % shardCount];
+    struct Wheel *own = wheel;
+    /* Their deadlines start over, on the timers of the shard's thread */
+    wheel = &sh->wheel;
+    struct Salon *s = SalonOf(sh, hs.id);
+    struct SalonState *st = StateOf(hs.id);
+    if (s == NULL || st == NULL)
+    {
+        DieWithError("Too many salons to take over");
+    }
+    atomic_store(&s->visits, hs.visits);
+    atomic_store(&s->served, hs.served);
+    atomic_store(&s->turnedAway, hs.turnedAway);
+    atomic_store(&s->abandoned, hs.abandoned);
+    atomic_store(&s->redirected, hs.redirected);
+    pthread_mutex_lock(&s->day.lock);
+    DayCopy(&s->day, &hs.day);
+    /* Its chairs open again as their hairdressers are taken over */
+    s->day.chairsOpen = 0;
+    s->day.chairsSince = TraceNow();
+    pthread_mutex_unlock(&s->day.lock);
+    memcpy(s->hops, hs.hops, sizeof(s->hops));
+
+    for (int i = 0; i < hs.hairdressers; i++)
+    {
+        RecvHandoff(conn, &r, sizeof(r), fds, 1);
+        struct Hairdresser *hd = calloc(1, sizeof(*hd));
+        if (hd == NULL)
+            DieWithError("calloc() failed");
+        s->hrdrs[s->hrdrCount++] = hd;
+        hd->salon = s;
+        hd->peer = r.peer;
+        AdoptPeer(&servHrdr, &hd->peer, fds[0]);
+        hd->alive = 1;
+        hd->firstChair = r.id;
+        hd->chairs = r.chairs;
+        for (int c = r.id; c < r.id + r.chairs; c++)
+        {
+            struct Chair *ch = MakeChair(s, c);
+            ch->owner = hd;
+            ChairIdle(ch);
+        }
+        pthread_mutex_lock(&s->day.lock);
+        DayChairs(&s->day, r.chairs, TraceNow());
+        pthread_mutex_unlock(&s->day.lock);
+        HairdresserSeen(hd);
+    }
+    for (int i = 0; i < hs.busyChairs; i++)
+    {
+        RecvHandoff(conn, &r, sizeof(r), fds, 1);
+        struct Chair *ch = s->chairs[r.id];
+        if (ch == NULL || ch->owner == NULL)
+            DieWithError("Not a handoff");
+        ch->visitor = r.visitor;
+        AdoptPeer(&servClnt, &ch->visitor.peer, fds[0]);
+        AdoptParty(&ch->visitor);
+        ch->seated = r.seated; /* The same clock for both servers */
+        ch->busy = 1;
+        ch->owner->busy++;
+        ChairTaken(ch);
+        TimerStart(&ch->overdue, OverdueMs(), HairdresserOverdue);
+    }
+    wheel = own;
+
+    st->seq = hs.seq;
+    st->historyFrom = hs.seq + 1;
+    memcpy(st->counts, hs.counts, sizeof(st->counts));
+    memcpy(st->chairs, hs.chairs, sizeof(st->chairs));
+    for (int i = 0; i < hs.queueLen; i++)
+    {
+        RecvHandoff(conn, &r, sizeof(r), fds, 1);
+        struct Visitor v = r.visitor;
+        AdoptPeer(&servClnt, &v.peer, fds[0]);
+        AdoptParty(&v);
+        Enqueue(s, &v);
+        BackDate(&AddWaiting(st, v.pid, 0)->arrived, r.waitedMs);
+    }
+    return hs.queueLen;
+}
+
+/* Take over from the server listening for a handoff at path */
+void TakeOver(const char *path)
+{
+    struct Endpoint ep;
+    struct HandoffHeader h;
+    struct HandoffRecord r;
+    int conn;
+    int fds[4];
+    int waiting = 0;
+
+    if (strlen(path) + strlen(UNIX_PREFIX) >= 128)
+        DieWithError("Invalid handoff path");
+    char port[128];
+    snprintf(port, sizeof(port), "%s%s", UNIX_PREFIX, path);
+    if (ParseEndpoint(NULL, port, &ep) < 0 || (conn = TransportConnect(&ep)) < 0)
+    {
+        DieWithError("Can't connect to the old server");
+    }
+
+    RecvHandoff(conn, &h, sizeof(h), fds, 4);
+    if (h.magic != HANDOFF_MAGIC || fds[2] < 0)
+    {
+        DieWithError("Not a handoff");
+    }
+    if (TransportAdopt(&servClnt, &h.eps[0], fds[0]) < 0 ||
+        TransportAdopt(&servHrdr, &h.eps[1], fds[1]) < 0 ||
+        TransportAdopt(&servObsrv, &h.eps[2], fds[2]) < 0)
+    {
+        DieWithError("Can't adopt the sockets");
+    }
+    if (h.gossip && fds[3] >= 0)
+    {
+        if (TransportAdopt(&servGossip, &h.eps[3], fds[3]) < 0)
+            DieWithError("Can't adopt the gossip socket");
+        gossipOn = 1;
+    }
+    BackDate(&startTime, h.uptimeMs);
+    atomic_store(&visitsLimited, h.visitsLimited);
+    nextObserverId = h.nextObserverId;
+    for (int i = 0; i < h.salons; i++)
+    {
+        waiting += TakeOverSalon(conn);
+    }
+
+    if ((observerTable = calloc(1, sizeof(struct ObserverTable))) == NULL)
+    {
+        DieWithError("malloc() failed");
+    }
+    for (int i = 0; i < h.observers; i++)
+    {
+        RecvHandoff(conn, &r, sizeof(r), fds, 1);
+        struct Observer *o = calloc(1, sizeof(*o));
+        struct FilterGroup *group = calloc(1, sizeof(*group));
+        if (o == NULL || group == NULL || (o->out = malloc(outCap * sizeof(struct OutMsg))) == NULL)
+        {
+            DieWithError("malloc() failed");
+        }
+        o->peer = r.peer;
+        AdoptPeer(&servObsrv, &o->peer, fds[0]);
+        o->id = r.id;
+        o->introduced = 1; /* Already has the state, the event stream just goes on */
+        group->pred = r.pred;
+        o->group = group;
+        struct ObserverTable *old = atomic_load(&observerTable);
+        struct ObserverTable *t = BuildTable(old, o, &group->pred, NULL);
+        if (t == NULL)
+        {
+            DieWithError("malloc() failed");
+        }
+        atomic_store(&observerTable, t);
+        free(old);
+        if (o->group != group)
+            free(group);
+        if (!o->group->started)
+        {
+            /* Whatever was sent before is not kept here, a NACK for it gets a resync */
+            struct SalonState *st = StateOf(o->group->pred.salon);
+            o->group->started = 1;
+            o->group->covered = st != NULL ? st->seq : 0;
+        }
+    }
+    /* Those not adopted yet: the rest are closed again */
+    struct Transport *ts[3] = {&servClnt, &servHrdr, &servObsrv};
+    for (int k = 0; k < 3; k++)
+    {
+        for (int i = 0; i < h.connections[k]; i++)
+        {
+            RecvHandoff(conn, &r, sizeof(r), fds, 1);
+            AdoptPeer(ts[k], &r.peer, fds[0]);
+        }
+    }
+    close(conn);
+    printf("Took over %d waiting in %d salons and %d observers\n", waiting, h.salons, h.observers);
+}
+
+/* What is left at the end of a round of the main loop */
+void EndRound()
+{
+    if (workerCount == 0)
+    {
+        DispatchShard(&shards[0]);
+    }
+    FlushReports();
+    FlushInboxes();
+}
+
+/* One salon's part of the day report */
+void PrintDay(FILE *f, struct Salon *s)
+{
+    struct DayStats d;
+    char when[32];
+
+    pthread_mutex_lock(&s->day.lock);
+    d = s->day;
+    pthread_mutex_unlock(&s->day.lock);
+    DayChairs(&d, 0, TraceNow());
+
+    fprintf(f, "\nSalon %u\n", s->id);
+    fprintf(f, "Arrivals:      %lu\n", atomic_load(&s->visits));
+    fprintf(f, "Served:        %lu\n", atomic_load(&s->served));
+    fprintf(f, "Rejected:      %lu\n", atomic_load(&s->turnedAway));
+    fprintf(f, "Gave up:       %lu\n", atomic_load(&s->abandoned));
+    if (atomic_load(&s->redirected) > 0)
+        fprintf(f, "Sent to peers: %lu\n", atomic_load(&s->redirected));
+    if (d.peakQueue > 0)
+    {
+        strftime(when, sizeof(when), "%H:%M:%S", localtime(&d.peakAt));
+        fprintf(f, "Peak queue:    %d at %s (%.1f s)\n", d.peakQueue, when, d.peakMs / 1000.0);
+    }
+    else
+    {
+        fprintf(f, "Peak queue:    0\n");
+    }
+    fprintf(f, "Utilization:   %.1f%% of %.2f chair-hours\n", d.chairNs > 0 ? 100 * d.busyNs / d.chairNs : 0.0,
+            d.chairNs / 3.6e12);
+    fprintf(f, "Wait, s:       mean %.2f  sd %.2f  max %.2f  p50 %.2f  p90 %.2f  p99 %.2f\n", d.wait.mean,
+            sqrt(WelfordVariance(&d.wait)), d.wait.max, P2Value(&d.waitQ[0]), P2Value(&d.waitQ[1]),
+            P2Value(&d.waitQ[2]));
+    fprintf(f, "Haircut, s:    mean %.2f  sd %.2f  max %.2f  p50 %.2f  p90 %.2f  p99 %.2f\n", d.service.mean,
+            sqrt(WelfordVariance(&d.service)), d.service.max, P2Value(&d.serviceQ[0]), P2Value(&d.serviceQ[1]),
+            P2Value(&d.serviceQ[2]));
+}
+
+/* Into a new file renamed over the old one, so that whoever picks it up
+   never sees half of it. final on shutdown */
+void WriteDayReport(int final)
+{
+    char tmp[PATH_MAX];
+    char when[32];
+    time_t now = time(NULL);
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", reportPath);
+    if ((f = fopen(tmp, "w")) == NULL)
+    {
+        perror("Can't write the day report");
+        return;
+    }
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    fprintf(f, "Day report at %s, %s, %.1f s after opening\n", when, final ? "closing" : "still open",
+            ElapsedMs(&startTime) / 1000.0);
+    for (int i = 0; i < shardCount; i++)
+    {
+        for (struct Salon *s = atomic_load(&shards[i].first); s != NULL; s = s->next)
+            PrintDay(f, s);
+    }
+    if (rateLimit > 0)
+        fprintf(f, "\nRate limited: %lu visits\n", atomic_load(&visitsLimited));
+    if (fclose(f) != 0 || rename(tmp, reportPath) < 0)
+    {
+        perror("Can't write the day report");
+        return;
+    }
+    printf("Day report written to %s\n", reportPath);
+}
+
+/* Runs on the main thread once a round is over. Everyone else is parked
+   first, so the counters it prints and reports are still and whole */
+void Shutdown()
+{
+    ParkAll();
+    struct Wheel total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < shardCount; i++)
+    {
+        for (struct Salon *s = shards[i].first; s != NULL; s = s->next)
+        {
+            printf("Salon %u: %lu visits, %lu served, %lu turned away, %lu gave up\n", s->id, s->visits, s->served,
+                   s->turnedAway, s->abandoned);
+            if (s->redirected > 0)
+                printf("%lu sent to peer servers\n", s->redirected);
+            /* Our hairdressers go home with us */
+            for (int c = 0; c < s->spawnedCount; c++)
+                kill(s->spawned[c].pid, SIGTERM);
+            printf("Hop latencies:\n");
+            for (int h = 0; h < HOPS; h++)
+            {
+                HistPrint(&s->hops[h], hopNames[h], stdout);
+            }
+        }
+        struct Wheel *w = &shards[i].wheel;
+        total.pending += w->pending;
+        total.fired += w->fired;
+        total.lagTotalMs += w->lagTotalMs;
+        if (w->lagMaxMs > total.lagMaxMs)
+            total.lagMaxMs = w->lagMaxMs;
+        if (shards[i].dropped > 0)
+            printf("Shard %d: %lu messages dropped, its inbox was full\n", i, shards[i].dropped);
+    }
+    if (rateLimit > 0)
+        PrintRateLimit();
+    if (reportPath != NULL)
+        WriteDayReport(1);
+    printf("Timers: %ld pending, %lu fired, expiry lag avg %.1f ms, max %ld ms\n", total.pending, total.fired,
+           total.fired > 0 ? (double)total.lagTotalMs / total.fired : 0.0, total.lagMaxMs);
+    TransportClose(&servClnt);
+    TransportClose(&servHrdr);
+    TransportClose(&servObsrv);
+    if (gossipOn)
+        TransportClose(&servGossip);
+    pthread_mutex_destroy(&tableLock);
+    close(info_pipe[0]);
+    close(info_pipe[1]);
+    TraceClose();
+    printf("disconnected\n");
+    exit(0);
+}
+
+void RunPoll()
+{
+    struct pollfd fds[5];
+    fds[0].fd = TransportPollFd(&servClnt);
+    fds[0].events = POLLIN;
+    fds[1].fd = TransportPollFd(&servHrdr);
+    fds[1].events = POLLIN;
+    fds[2].fd = handoffPath != NULL ? servHandoff.fd : -1; /* The listening socket itself, not its epoll */
+    fds[2].events = POLLIN;
+    fds[3].fd = wheel != NULL ? wheel->fd : -1;
+    fds[3].events = POLLIN;
+    fds[4].fd = shutdownWake;
+    fds[4].events = POLLIN;
+    for (;;)
+    {
+        if (wheel != NULL)
+            TimerRearm();
+        if (poll(fds, 5, -1) < 0 && errno != EINTR)
+        {
+            DieWithError("poll() failed");
+        }
+        if (fds[2].revents & POLLIN)
+        {
+            HandOver();
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            HandleHairdresser();
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            HandleUDPClient();
+        }
+        if (fds[3].revents & POLLIN)
+        {
+            HandleTimers();
+        }
+        EndRound();
+        if (fds[4].revents & POLLIN)
+        {
+            Shutdown();
+        }
+    }
+}
+
+/* Falls back to poll() unless the kernel has what we need. SEQPACKET
+   connections are multiplexed by epoll in transport.c, so they stay there too */
+void StartUring()
+{
+    useUring = 0;
+    if (servClnt.kind != TRANSPORT_UDP || servHrdr.kind != TRANSPORT_UDP)
+    {
+        printf("io_uring is only used with UDP, using poll()\n");
+        return;
+    }
+    if (UringInit(&ring, URING_ENTRIES) < 0 || UringBufRingInit(&ring, &recvBufs, 0, RECV_BUFS, RECV_BUF_BYTES) < 0)
+    {
+        printf("io_uring is not available (%s), using poll()\n", strerror(errno));
+        return;
+    }
+    memset(&recvShape, 0, sizeof(recvShape));
+    recvShape.msg_namelen = sizeof(struct sockaddr_in);
+    for (int i = 0; i < SEND_SLOTS; i++)
+    {
+        freeSlots[freeSlotCount++] = i;
+    }
+    useUring = 1;
+    printf("Using io_uring\n");
+}
+
+void ArmRecv(int tag, int fd)
+{
+    struct io_uring_sqe *sqe = UringSqe(&ring);
+    if (sqe == NULL)
+    {
+        return; /* Next round */
+    }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)&recvShape;
+    sqe->len = 1;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = recvBufs.group;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = tag;
+    armed[tag] = 1;
+}
+
+void ArmHandoff()
+{
+    struct io_uring_sqe *sqe = UringSqe(&ring);
+    if (sqe == NULL)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = servHandoff.fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = TAG_HANDOFF;
+    armed[TAG_HANDOFF] = 1;
+}
+
+void ArmTimer()
+{
+    struct io_uring_sqe *sqe = UringSqe(&ring);
+    if (sqe == NULL)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = wheel->fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = TAG_TIMER;
+    armed[TAG_TIMER] = 1;
+}
+
+void ArmShutdown()
+{
+    struct io_uring_sqe *sqe = UringSqe(&ring);
+    if (sqe == NULL)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = shutdownWake;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = TAG_SHUTDOWN;
+    armed[TAG_SHUTDOWN] = 1;
+}
+
+void HandleCompletion(const struct io_uring_cqe *cqe)
+{
+    int tag = cqe->user_data & 0xff;
+    struct Peer from;
+
+    if (tag == TAG_SEND)
+    {
+        freeSlots[freeSlotCount++] = cqe->user_data >> 8;
+        return;
+    }
+    if (tag == TAG_CANCEL)
+    {
+        return;
+    }
+    if (tag == TAG_HANDOFF)
+    {
+        armed[TAG_HANDOFF] = 0;
+        handoffReady = 1;
+        return;
+    }
+    if (tag == TAG_SHUTDOWN)
+    {
+        armed[TAG_SHUTDOWN] = 0;
+        shutdownReady = 1;
+        return;
+    }
+    if (tag == TAG_TIMER)
+    {
+        armed[TAG_TIMER] = 0;
+        HandleTimers();
+        return;
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        /* Out of buffers or cancelled, armed again next round */
+        armed[tag] = 0;
+    }
+    if (cqe->res < 0 || !(cqe->flags & IORING_CQE_F_BUFFER))
+    {
+        if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+        {
+            errno = -cqe->res;
+            DieWithError(tag == TAG_CLIENT ? "recvmsg() from client failed" : "recvmsg() from hairdresser failed");
+        }
+        return;
+    }
+
+    unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)UringBuf(&recvBufs, bid);
+    char *name = (char *)(out + 1);
+    char *payload = name + recvShape.msg_namelen + recvShape.msg_controllen;
+    from.fd = -1;
+    from.addrLen = out->namelen < recvShape.msg_namelen ? out->namelen : recvShape.msg_namelen;
+    memcpy(&from.addr, name, from.addrLen);
+    if (!(out->flags & MSG_TRUNC))
+    {
+        Route(tag == TAG_CLIENT ? INBOX_CLIENT : INBOX_HRDR, payload, out->payloadlen, &from);
+    }
+    UringBufReturn(&recvBufs, bid);
+}
+
+/* Stop receiving and wait for every send, so that the sockets can be
+   handed over with nothing in flight */
+void StopUring()
+{
+    struct io_uring_cqe *cqe;
+
+    for (int tag = TAG_CLIENT; tag <= TAG_HRDR; tag++)
+    {
+        struct io_uring_sqe *sqe;
+        while (armed[tag] && (sqe = UringSqe(&ring)) == NULL)
+            UringSubmit(&ring, 0);
+        if (armed[tag])
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = tag;
+            sqe->user_data = TAG_CANCEL;
+        }
+    }
+    while (armed[TAG_CLIENT] || armed[TAG_HRDR] || freeSlotCount < SEND_SLOTS)
+    {
+        if (UringSubmit(&ring, -1) < 0)
+            DieWithError("io_uring_enter() failed");
+        while ((cqe = UringPeek(&ring)) != NULL)
+        {
+            HandleCompletion(cqe);
+            UringSeen(&ring);
+        }
+    }
+    useUring = 0;
+}
+
+/* Same loop as RunPoll(), with one io_uring_enter() per round
+   for all the sends of the last round and the wait for the next one */
+void RunUring()
+{
+    struct io_uring_cqe *cqe;
+
+    for (;;)
+    {
+        if (!armed[TAG_CLIENT])
+            ArmRecv(TAG_CLIENT, servClnt.fd);
+        if (!armed[TAG_HRDR])
+            ArmRecv(TAG_HRDR, servHrdr.fd);
+        if (handoffPath != NULL && !armed[TAG_HANDOFF])
+            ArmHandoff();
+        if (wheel != NULL && !armed[TAG_TIMER])
+            ArmTimer();
+        if (!armed[TAG_SHUTDOWN])
+            ArmShutdown();
+        if (wheel != NULL)
+            TimerRearm();
+        if (UringSubmit(&ring, UringPeek(&ring) != NULL ? 0 : -1) < 0)
+        {
+            DieWithError("io_uring_enter() failed");
+        }
+        while ((cqe = UringPeek(&ring)) != NULL)
+        {
+            HandleCompletion(cqe);
+            UringSeen(&ring);
+        }
+        if (handoffReady)
+        {
+            handoffReady = 0;
+            StopUring();
+            HandOver();
+            /* Still here: nobody to hand over to after all */
+            useUring = 1;
+        }
+        EndRound();
+        if (shutdownReady)
+        {
+            StopUring();
+            Shutdown();
+        }
+    }
+}
+
+/* Every other thread has the signals blocked, so this one takes them all.
+   Being an ordinary thread, it may lock and write files as it likes. Closing
+   is left to the main thread, which can stop the others between rounds */
+void *SignalThread(void *arg)
+{
+    sigset_t *set = arg;
+    int sig;
+    uint64_t one = 1;
+
+    for (;;)
+    {
+        if (sigwait(set, &sig) != 0)
+            continue;
+        if (sig == SIGUSR1)
+            WriteDayReport(0);
+        else
+            write(shutdownWake, &one, sizeof(one));
+    }
+}
+
+void StartSignals()
+{
+    static sigset_t set;
+    pthread_t thread;
+
+    if ((shutdownWake = eventfd(0, EFD_NONBLOCK)) < 0)
+    {
+        DieWithError("eventfd() failed");
+    }
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    if (reportPath != NULL)
+        sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    pthread_create(&thread, NULL, SignalThread, &set);
+}
+
+int main(int argc, char *argv[])
+{
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+    int opt;
+    char *takeoverPath = NULL;
+    char *gossipPort = NULL;
+    while ((opt = getopt(argc, argv, "c:d:q:k:s:m:uw:g:p:a:t:r:R:H:T:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            coalesceMs = atoi(optarg);
+            break;
+        case 'd':
+            if (strcmp(optarg, "drop-oldest") == 0)
+                dropPolicy = DROP_OLDEST;
+            else if (strcmp(optarg, "drop-newest") == 0)
+                dropPolicy = DROP_NEWEST;
+            else if (strcmp(optarg, "disconnect") == 0)
+                dropPolicy = DROP_DISCONNECT;
+            else
+                argc = 0;
+            break;
+        case 'q':
+            if ((outCap = atoi(optarg)) <= 0)
+                argc = 0;
+            break;
+        case 'k':
+            if ((historyLen = atoi(optarg)) <= 0)
+                argc = 0;
+            break;
+        case 's':
+            if ((serviceMs = atoi(optarg)) <= 0)
+                argc = 0;
+            break;
+        case 'm':
+            maxWaiting = atoi(optarg);
+            break;
+        case 'u':
+            useUring = 1;
+            break;
+        case 'w':
+            if ((workerCount = atoi(optarg)) < 0)
+                argc = 0;
+            break;
+        case 'g':
+            gossipPort = optarg;
+            break;
+        case 'p':
+            if (AddPeerServer(optarg) < 0)
+                argc = 0;
+            break;
+        case 'a':
+            if (sscanf(optarg, "%d:%d", &scaleMin, &scaleMax) != 2 || scaleMin < 0 || scaleMax < scaleMin ||
+                scaleMax == 0)
+                argc = 0;
+            break;
+        case 't':
+            if ((targetWaitMs = atoi(optarg)) <= 0)
+                argc = 0;
+            break;
+        case 'r':
+            /* <visits per second>[:<burst>] */
+            rateBurst = 0;
+            if (sscanf(optarg, "%lf:%lf", &rateLimit, &rateBurst) < 1 || rateLimit <= 0 || rateBurst < 0)
+                argc = 0;
+            if (rateBurst < 1)
+                rateBurst = rateLimit > 1 ? rateLimit : 1;
+            break;
+        case 'R':
+            reportPath = optarg;
+            break;
+        case 'H':
+            handoffPath = optarg;
+            break;
+        case 'T':
+            takeoverPath = optarg;
+            break;
+        default:
+            argc = 0;
+        }
+    }
+
+    if (argc - optind != (takeoverPath == NULL ? 4 : 0)) /* Test for correct number of arguments */
+    {
+        fprintf(stderr, "Usage:  %s [-c <coalescing window, ms>] [-d drop-oldest|drop-newest|disconnect] [-q <observer queue length>] [-k <events kept for observers that missed some>] [-s <expected haircut time, ms>] [-m <max waiting>] [-u] [-w <worker threads>] [-g <gossip port> [-p <peer ip>:<gossip port>]...] [-a <min>:<max hairdressers> [-t <target wait, ms>]] [-r <visits per second per host>[:<burst>]] [-R <day report file>] [-H <handoff socket>] <Server Address> <Port for Clients> <Port for Haidresser> <Port for Observers>\n", argv[0]);
+        fprintf(stderr, "        %s [options] -T <handoff socket of the running server>\n", argv[0]);
+        fprintf(stderr, "Any port may be given as unix:<path> to use a Unix-domain socket, except the gossip port\n");
+        fprintf(stderr, "With -T the gossip socket, if any, comes from the running server\n");
+        fprintf(stderr, "With -R the day report is also written on SIGUSR1\n");
+        exit(1);
+    }
+    argv += optind - 1;
+
+    /* Salons are sharded over the workers, or all run by the main thread */
+    shardCount = workerCount > 0 ? workerCount : 1;
+    if ((shards = calloc(shardCount, sizeof(*shards))) == NULL)
+    {
+        DieWithError("calloc() failed");
+    }
+    for (int i = 0; i < shardCount; i++)
+    {
+        TimerInit(&shards[i].wheel);
+    }
+    /* Before any other thread, so that they all inherit the mask */
+    StartSignals();
+    ioThread = 1;
+    wheel = workerCount == 0 ? &shards[0].wheel : NULL;
+    sem_init(&writerParked, 0, 0);
+    sem_init(&shardParked, 0, 0);
+    TraceOpen(NULL, "server");
+    TraceThread("main");
+
+    if (takeoverPath != NULL)
+    {
+        TakeOver(takeoverPath);
+    }
+    else
+    {
+        createSocket(&servClnt, argv[1], argv[2]);
+        createSocket(&servHrdr, argv[1], argv[3]);
+        createSocket(&servObsrv, argv[1], argv[4]);
+        /* The hairdresser is welcome whenever it registers */
+    }
+    if (gossipPort != NULL && !gossipOn)
+    {
+        createSocket(&servGossip, takeoverPath == NULL ? argv[1] : "0.0.0.0", gossipPort);
+        if (servGossip.kind != TRANSPORT_UDP)
+            DieWithError("The gossip port must be UDP");
+        gossipOn = 1;
+    }
+    if (peerServerCount > 0 && !gossipOn)
+    {
+        fprintf(stderr, "Peer servers (-p) need a gossip port (-g)\n");
+        exit(1);
+    }
+    if (handoffPath != NULL)
+    {
+        char port[128];
+        snprintf(port, sizeof(port), "%s%s", UNIX_PREFIX, handoffPath);
+        createSocket(&servHandoff, NULL, port);
+    }
+
+    pthread_mutex_init(&tableLock, NULL);
+    pthread_mutex_init(&nackLock, NULL);
+    if ((writerWake = eventfd(0, EFD_NONBLOCK)) < 0)
+    {
+        DieWithError("eventfd() failed");
+    }
+    setObservers();
+    StartWriter();
+    if (scaleMin >= 0)
+    {
+        StartAutoscaler();
+    }
+    if (rateLimit > 0)
+    {
+        StartRateLimit();
+    }
+    StartShards();
+    StartGossip();
+
+    if (useUring)
     {
-        HandleUDPClient();
+        StartUring();
     }
+    if (useUring)
+        RunUring();
+    else
+        RunPoll();
 }
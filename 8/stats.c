@@ -0,0 +1,178 @@
+#include <string.h> /* for memset() */
+
+#include "stats.h"
+
+void P2Init(struct P2Quantile *e, double p)
+{
+    memset(e, 0, sizeof(*e));
+    e->p = p;
+    for (int i = 0; i < 5; i++)
+    {
+        e->n[i] = i;
+    }
+    e->np[0] = 0;
+    e->np[1] = 2 * p;
+    e->np[2] = 4 * p;
+    e->np[3] = 2 + 2 * p;
+    e->np[4] = 4;
+    e->dn[0] = 0;
+    e->dn[1] = p / 2;
+    e->dn[2] = p;
+    e->dn[3] = (1 + p) / 2;
+    e->dn[4] = 1;
+}
+
+static double parabolic(const struct P2Quantile *e, int i, double d)
+{
+    return e->q[i] + d / (e->n[i + 1] - e->n[i - 1]) *
+                         ((e->n[i] - e->n[i - 1] + d) * (e->q[i + 1] - e->q[i]) / (e->n[i + 1] - e->n[i]) +
+                          (e->n[i + 1] - e->n[i] - d) * (e->q[i] - e->q[i - 1]) / (e->n[i] - e->n[i - 1]));
+}
+
+static double linear(const struct P2Quantile *e, int i, int d)
+{
+    return e->q[i] + d * (e->q[i + d] - e->q[i]) / (e->n[i + d] - e->n[i]);
+}
+
+void P2Add(struct P2Quantile *e, double x)
+{
+    int k;
+
+    if (e->count < 5)
+    {
+        /* Keep the first five observations sorted */
+        for (k = e->count; k > 0 && e->q[k - 1] > x; k--)
+        {
+            e->q[k] = e->q[k - 1];
+        }
+        e->q[k] = x;
+        e->count++;
+        return;
+    }
+    e->count++;
+
+    /* Find the cell x falls into, stretching the extremes if needed */
+    if (x < e->q[0])
+    {
+        e->q[0] = x;
+        k = 0;
+    }
+    else if (x >= e->q[4])
+    {
+        e->q[4] = x;
+        k = 3;
+    }
+    else
+    {
+        for (k = 0; k < 3 && x >= e->q[k + 1]; k++)
+            ;
+    }
+
+    for (int i = k + 1; i < 5; i++)
+    {
+        e->n[i]++;
+    }
+    for (int i = 0; i < 5; i++)
+    {
+        e->np[i] += e->dn[i];
+    }
+
+    /* Move the middle markers towards their desired positions */
+    for (int i = 1; i < 4; i++)
+    {
+        double d = e->np[i] - e->n[i];
+        if ((d >= 1 && e->n[i + 1] - e->n[i] > 1) || (d <= -1 && e->n[i - 1] - e->n[i] < -1))
+        {
+            int step = d > 0 ? 1 : -1;
+            double q = parabolic(e, i, step);
+            if (e->q[i - 1] < q && q < e->q[i + 1])
+                e->q[i] = q;
+            else
+                e->q[i] = linear(e, i, step);
+            e->n[i] += step;
+        }
+    }
+}
+
+double P2Value(const struct P2Quantile *e)
+{
+    if (e->count == 0)
+    {
+        return 0;
+    }
+    if (e->count < 5)
+    {
+        /* Exact, from the sorted observations */
+        return e->q[(int)(e->p * (e->count - 1) + 0.5)];
+    }
+    return e->q[2];
+}
+
+void WelfordAdd(struct Welford *w, double x)
+{
+    double d = x - w->mean;
+
+    w->count++;
+    w->mean += d / w->count;
+    w->m2 += d * (x - w->mean);
+    if (w->count == 1 || x > w->max)
+        w->max = x;
+}
+
+double WelfordVariance(const struct Welford *w)
+{
+    return w->count > 1 ? w->m2 / (w->count - 1) : 0;
+}
+
+void HistAdd(struct Histogram *h, long long ns)
+{
+    int b = 0;
+
+    if (ns < 0)
+    {
+        h->negative++;
+        ns = 0;
+    }
+    while (b < HIST_BUCKETS - 1 && ns >= 1LL << b)
+    {
+        b++;
+    }
+    h->buckets[b]++;
+    h->count++;
+    h->sumNs += ns;
+    if (ns > h->maxNs)
+        h->maxNs = ns;
+}
+
+long long HistQuantile(const struct Histogram *h, double p)
+{
+    unsigned long seen = 0;
+
+    for (int b = 0; b < HIST_BUCKETS; b++)
+    {
+        seen += h->buckets[b];
+        if (seen > 0 && seen >= p * h->count)
+            return 1LL << b;
+    }
+    return h->maxNs;
+}
+
+void HistPrint(const struct Histogram *h, const char *name, FILE *out)
+{
+    if (h->count == 0)
+    {
+        fprintf(out, "%-16s no samples\n", name);
+        return;
+    }
+    fprintf(out, "%-16s %lu samples, avg %.1f us, p50 < %.1f us, p99 < %.1f us, max %.1f us", name, h->count,
+            h->sumNs / h->count / 1000, HistQuantile(h, 0.5) / 1000.0, HistQuantile(h, 0.99) / 1000.0,
+            h->maxNs / 1000.0);
+    if (h->negative > 0)
+        fprintf(out, ", %lu negative", h->negative);
+    fprintf(out, "\n");
+    for (int b = 0; b < HIST_BUCKETS; b++)
+    {
+        if (h->buckets[b] > 0)
+            fprintf(out, "%16s < %10.1f us: %lu\n", "", (1LL << b) / 1000.0, h->buckets[b]);
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h> /* for FILE */
+
+/* P-square estimate of one quantile in constant memory (Jain and Chlamtac, 1985) */
+struct P2Quantile
+{
+    double p;
+    long count;
+    double q[5];  /* Marker heights */
+    double n[5];  /* Marker positions */
+    double np[5]; /* Desired marker positions */
+    double dn[5]; /* Increments of the desired positions */
+};
+
+void P2Init(struct P2Quantile *e, double p);
+
+void P2Add(struct P2Quantile *e, double x);
+
+/* 0 until something was added */
+double P2Value(const struct P2Quantile *e);
+
+/* Running mean and variance in constant memory (Welford, 1962) */
+struct Welford
+{
+    long count;
+    double mean;
+    double m2; /* Sum of squared distances from the mean */
+    double max;
+};
+
+void WelfordAdd(struct Welford *w, double x);
+
+/* Sample variance, 0 below two values */
+double WelfordVariance(const struct Welford *w);
+
+/* Latency histogram with a bucket per power of two of ns, in constant memory */
+#define HIST_BUCKETS 40
+
+struct Histogram
+{
+    unsigned long count;
+    unsigned long negative; /* Below the error of the clock offset */
+    double sumNs;
+    long long maxNs;
+    unsigned long buckets[HIST_BUCKETS]; /* buckets[i]: below 2^i ns */
+};
+
+void HistAdd(struct Histogram *h, long long ns);
+
+/* Upper bound of the bucket holding quantile p, ns */
+long long HistQuantile(const struct Histogram *h, double p);
+
+/* One line of totals and one per non-empty bucket */
+void HistPrint(const struct Histogram *h, const char *name, FILE *out);
+
+#endif
@@ -0,0 +1,206 @@
+#include <stdio.h>       /* for snprintf() */
+#include <stdlib.h>      /* for calloc() and getenv() */
+#include <fcntl.h>       /* for open() */
+#include <unistd.h>      /* for write(), getpid() and syscall() */
+#include <sys/syscall.h> /* for SYS_gettid */
+#include <stdatomic.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define TRACE_EVENTS 1024 /* Per thread, written out when full */
+#define TRACE_CHUNK 16384 /* Bytes per write() */
+
+struct TraceEvent
+{
+    const char *name; /* Not copied: string literals only */
+    char ph;
+    uint64_t ts; /* ns */
+    uint64_t dur;
+    int visitor;
+    int tid;
+};
+
+/* Written by its thread only. count is published with release, so that
+   TraceClose() on another thread sees whole events */
+struct TraceBuffer
+{
+    struct TraceEvent events[TRACE_EVENTS];
+    atomic_int count;
+    atomic_int flushing; /* Whoever sets it writes the buffer out */
+    int tid;
+    struct TraceBuffer *next;
+};
+
+static int traceFd = -1;
+static int tracePid;
+static _Atomic(struct TraceBuffer *) buffers; /* Every thread's, pushed without a lock */
+static __thread struct TraceBuffer *mine;
+static __thread int track;
+
+uint64_t TraceNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct TraceBuffer *buffer(void)
+{
+    if (mine == NULL && (mine = calloc(1, sizeof(*mine))) != NULL)
+    {
+        mine->tid = syscall(SYS_gettid);
+        mine->next = atomic_load(&buffers);
+        while (!atomic_compare_exchange_weak(&buffers, &mine->next, mine))
+            ;
+    }
+    return mine;
+}
+
+static int format(char *out, size_t size, const struct TraceEvent *e)
+{
+    int tid = e->tid;
+    int n = snprintf(out, size, "{\"name\":\"%s\",\"cat\":\"salon\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%d",
+                     e->name, e->ph, (unsigned long long)(e->ts / 1000), (unsigned)(e->ts % 1000), tracePid, tid);
+    switch (e->ph)
+    {
+    case 'X':
+        n += snprintf(out + n, size - n, ",\"dur\":%llu.%03u", (unsigned long long)(e->dur / 1000),
+                      (unsigned)(e->dur % 1000));
+        if (e->visitor > 0)
+            n += snprintf(out + n, size - n, ",\"args\":{\"visitor\":%d}", e->visitor);
+        break;
+    case 's':
+        n += snprintf(out + n, size - n, ",\"id\":%d", e->visitor);
+        break;
+    case 't':
+    case 'f':
+        n += snprintf(out + n, size - n, ",\"id\":%d,\"bp\":\"e\"", e->visitor);
+        break;
+    case 'b':
+    case 'e':
+        n += snprintf(out + n, size - n, ",\"id\":%d,\"args\":{\"visitor\":%d}", e->visitor, e->visitor);
+        break;
+    case 'M':
+        /* name is the process or thread name, e->visitor tells which */
+        n = snprintf(out, size, "{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}",
+                     e->visitor ? "process_name" : "thread_name", tracePid, tid, e->name);
+        break;
+    }
+    n += snprintf(out + n, size - n, "},\n");
+    return n;
+}
+
+static void flush(struct TraceBuffer *b)
+{
+    char out[TRACE_CHUNK];
+    int len = 0;
+
+    if (atomic_exchange(&b->flushing, 1))
+    {
+        return;
+    }
+    int count = atomic_load_explicit(&b->count, memory_order_acquire);
+    for (int i = 0; i < count; i++)
+    {
+        if (len > TRACE_CHUNK - 512)
+        {
+            write(traceFd, out, len);
+            len = 0;
+        }
+        len += format(out + len, TRACE_CHUNK - len, &b->events[i]);
+    }
+    if (len > 0)
+    {
+        write(traceFd, out, len);
+    }
+    atomic_store_explicit(&b->count, 0, memory_order_release);
+    atomic_store(&b->flushing, 0);
+}
+
+static void record(const char *name, char ph, uint64_t ts, uint64_t dur, int visitor)
+{
+    struct TraceBuffer *b;
+
+    if (traceFd < 0 || (b = buffer()) == NULL)
+    {
+        return;
+    }
+    int count = atomic_load_explicit(&b->count, memory_order_relaxed);
+    if (count == TRACE_EVENTS)
+    {
+        flush(b);
+        if ((count = atomic_load_explicit(&b->count, memory_order_relaxed)) == TRACE_EVENTS)
+        {
+            return; /* TraceClose() has it */
+        }
+    }
+    struct TraceEvent *e = &b->events[count];
+    e->name = name;
+    e->ph = ph;
+    e->ts = ts;
+    e->dur = dur;
+    e->visitor = visitor;
+    e->tid = track != 0 ? track : b->tid;
+    atomic_store_explicit(&b->count, count + 1, memory_order_release);
+}
+
+void TraceOpen(const char *path, const char *process)
+{
+    if (path == NULL && (path = getenv(TRACE_ENV)) == NULL)
+    {
+        return;
+    }
+    tracePid = getpid();
+    /* Whoever creates the file opens the array. It is never closed,
+       which the trace viewers accept, so that any process may end last */
+    if ((traceFd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644)) >= 0)
+    {
+        write(traceFd, "[\n", 2);
+    }
+    else if ((traceFd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC)) < 0)
+    {
+        perror("Can't open the trace file");
+        return;
+    }
+    record(process, 'M', 0, 0, 1);
+}
+
+void TraceTrack(int t)
+{
+    track = t;
+}
+
+void TraceThread(const char *name)
+{
+    record(name, 'M', 0, 0, 0);
+}
+
+void TraceSlice(const char *name, uint64_t start, int visitor)
+{
+    record(name, 'X', start, TraceNow() - start, visitor);
+}
+
+void TraceFlow(char ph, uint64_t at, int visitor)
+{
+    record("visit", ph, at, 0, visitor);
+}
+
+void TraceAsync(const char *name, char ph, int visitor)
+{
+    record(name, ph, TraceNow(), 0, visitor);
+}
+
+void TraceClose(void)
+{
+    if (traceFd < 0)
+    {
+        return;
+    }
+    for (struct TraceBuffer *b = atomic_load(&buffers); b != NULL; b = b->next)
+    {
+        flush(b);
+    }
+    close(traceFd);
+    traceFd = -1;
+}
@@ -0,0 +1,42 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h> /* for uint64_t */
+
+/* Trace events in the Chrome trace-event JSON format, which chrome://tracing
+   and ui.perfetto.dev both open. Every thread records into a buffer of its
+   own without locks, full buffers are appended to the file in one write(),
+   so server, hairdresser and clients can all share one file.
+   Timestamps are CLOCK_MONOTONIC, the same clock in every process on the host.
+   Flow events with the visitor id as their id link one visit across processes.
+   Does nothing until TraceOpen() */
+
+#define TRACE_ENV "SALON_TRACE" /* Name of the trace file */
+
+/* Start tracing to path, or to $SALON_TRACE if path is NULL. process names this process in the UI */
+void TraceOpen(const char *path, const char *process);
+
+/* Name the calling thread in the UI */
+void TraceThread(const char *name);
+
+/* Record what this thread does next as if on another thread, say one per
+   chair of a hairdresser that cuts in several at once. 0 to go back */
+void TraceTrack(int track);
+
+/* Now, in the units of the trace */
+uint64_t TraceNow(void);
+
+/* Slice from start until now on this thread. visitor <= 0 for none */
+void TraceSlice(const char *name, uint64_t start, int visitor);
+
+/* Visit flow: ph is 's' where it starts, 't' for each step and 'f' where it ends.
+   Binds to the slice of this thread that encloses at */
+void TraceFlow(char ph, uint64_t at, int visitor);
+
+/* Span of one visitor that starts and ends in different places of this process: ph 'b' or 'e' */
+void TraceAsync(const char *name, char ph, int visitor);
+
+/* Write out what every thread has recorded. Other threads had better be idle */
+void TraceClose(void);
+
+#endif
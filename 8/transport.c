@@ -0,0 +1,393 @@
+#define _GNU_SOURCE /* for accept4() */
+
+#include <stdio.h>      /* for snprintf() */
+#include <sys/socket.h> /* for socket(), bind(), connect(), accept() */
+#include <sys/un.h>     /* for sockaddr_un */
+#include <sys/uio.h>    /* for iovec */
+#include <sys/epoll.h>  /* for epoll_create1() and epoll_wait() */
+#include <arpa/inet.h>  /* for sockaddr_in and inet_ntoa() */
+#include <stdlib.h>     /* for atoi() and realloc() */
+#include <string.h>     /* for memset() */
+#include <unistd.h>     /* for close() */
+#include <errno.h>
+
+#include "transport.h"
+
+int ParseEndpoint(const char *ip, const char *port, struct Endpoint *ep)
+{
+    memset(ep, 0, sizeof(*ep));
+
+    if (strncmp(port, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0)
+    {
+        struct sockaddr_un *un = (struct sockaddr_un *)&ep->addr;
+        const char *path = port + strlen(UNIX_PREFIX);
+        if (strlen(path) == 0 || strlen(path) >= sizeof(un->sun_path))
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        ep->kind = TRANSPORT_UNIX;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path);
+        ep->addrLen = sizeof(*un);
+        return 0;
+    }
+
+    struct sockaddr_in *in = (struct sockaddr_in *)&ep->addr;
+    ep->kind = TRANSPORT_UDP;
+    in->sin_family = AF_INET;            /* Internet address family */
+    in->sin_addr.s_addr = inet_addr(ip); /* Server IP address */
+    in->sin_port = htons(atoi(port));    /* Server port */
+    ep->addrLen = sizeof(*in);
+    if (in->sin_addr.s_addr == INADDR_NONE)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+static int openSocket(int kind)
+{
+    if (kind == TRANSPORT_UNIX)
+    {
+        return socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    }
+    return socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+}
+
+int TransportConnect(const struct Endpoint *ep)
+{
+    int sock;
+
+    if ((sock = openSocket(ep->kind)) < 0)
+    {
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&ep->addr, ep->addrLen) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static int watch(int epfd, int fd)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* Remember a connection until forget() */
+static int track(struct Transport *t, int conn)
+{
+    int ok = 0;
+    pthread_mutex_lock(&t->connLock);
+    if (t->connCount == t->connCap)
+    {
+        int cap = t->connCap > 0 ? t->connCap * 2 : 16;
+        int *grown = realloc(t->conns, cap * sizeof(*grown));
+        if (grown == NULL)
+            ok = -1;
+        else
+        {
+            t->conns = grown;
+            t->connCap = cap;
+        }
+    }
+    if (ok == 0)
+        t->conns[t->connCount++] = conn;
+    pthread_mutex_unlock(&t->connLock);
+    return ok;
+}
+
+static void initConns(struct Transport *t)
+{
+    t->conns = NULL;
+    t->connCount = 0;
+    t->connCap = 0;
+    pthread_mutex_init(&t->connLock, NULL);
+}
+
+int TransportListen(struct Transport *t, const struct Endpoint *ep)
+{
+    t->kind = ep->kind;
+    t->ep = *ep;
+    t->epfd = -1;
+    initConns(t);
+
+    if ((t->fd = openSocket(ep->kind)) < 0)
+    {
+        return -1;
+    }
+
+    if (ep->kind == TRANSPORT_UNIX)
+    {
+        /* A stale socket file from a previous run would make bind() fail */
+        unlink(((struct sockaddr_un *)&ep->addr)->sun_path);
+    }
+
+    if (bind(t->fd, (struct sockaddr *)&ep->addr, ep->addrLen) < 0)
+    {
+        return -1;
+    }
+
+    if (ep->kind == TRANSPORT_UNIX)
+    {
+        if (listen(t->fd, SOMAXCONN) < 0)
+        {
+            return -1;
+        }
+        if ((t->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 || watch(t->epfd, t->fd) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int TransportAdopt(struct Transport *t, const struct Endpoint *ep, int fd)
+{
+    t->kind = ep->kind;
+    t->ep = *ep;
+    t->fd = fd;
+    t->epfd = -1;
+    initConns(t);
+    if (ep->kind == TRANSPORT_UNIX)
+    {
+        if ((t->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 || watch(t->epfd, t->fd) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int TransportAdoptPeer(struct Transport *t, const struct Peer *p)
+{
+    if (t->kind == TRANSPORT_UNIX)
+    {
+        return watch(t->epfd, p->fd) < 0 || track(t, p->fd) < 0 ? -1 : 0;
+    }
+    return 0;
+}
+
+int TransportConnections(struct Transport *t, int **fds)
+{
+    int n;
+    pthread_mutex_lock(&t->connLock);
+    n = t->connCount;
+    if ((*fds = malloc((n > 0 ? n : 1) * sizeof(**fds))) == NULL)
+        n = -1;
+    else
+        memcpy(*fds, t->conns, n * sizeof(**fds));
+    pthread_mutex_unlock(&t->connLock);
+    return n;
+}
+
+#define MAX_PASSED_FDS 16
+
+ssize_t SendWithFds(int sock, const void *buf, size_t len, const int *fds, int nfds)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    char control[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds > 0)
+    {
+        if (nfds > MAX_PASSED_FDS)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+    return sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+ssize_t RecvWithFds(int sock, void *buf, size_t len, int *fds, int *nfds)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    char control[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+    ssize_t n;
+    int room = *nfds;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    *nfds = 0;
+    if ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0)
+    {
+        return -1;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int *received = (int *)CMSG_DATA(cmsg);
+            for (int i = 0; i < count; i++)
+            {
+                if (*nfds < room)
+                    fds[(*nfds)++] = received[i];
+                else
+                    close(received[i]);
+            }
+        }
+    }
+    return n;
+}
+
+static void forget(struct Transport *t, int conn)
+{
+    pthread_mutex_lock(&t->connLock);
+    for (int i = 0; i < t->connCount; i++)
+    {
+        if (t->conns[i] == conn)
+        {
+            t->conns[i] = t->conns[--t->connCount];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&t->connLock);
+    epoll_ctl(t->epfd, EPOLL_CTL_DEL, conn, NULL);
+    close(conn);
+}
+
+ssize_t TransportRecv(struct Transport *t, void *buf, size_t len, struct Peer *from, int flags)
+{
+    ssize_t n;
+
+    if (t->kind == TRANSPORT_UDP)
+    {
+        from->fd = -1;
+        from->addrLen = sizeof(from->addr);
+        return recvfrom(t->fd, buf, len, flags, (struct sockaddr *)&from->addr, &from->addrLen);
+    }
+
+    /* SEQPACKET: wait for a new connection or a message on an accepted one */
+    for (;;)
+    {
+        struct epoll_event ev;
+        int ready = epoll_wait(t->epfd, &ev, 1, (flags & MSG_DONTWAIT) ? 0 : -1);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        if (ready == 0)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        if (ev.data.fd == t->fd)
+        {
+            int conn = accept4(t->fd, NULL, NULL, SOCK_CLOEXEC);
+            if (conn >= 0 && (watch(t->epfd, conn) < 0 || track(t, conn) < 0))
+            {
+                close(conn);
+            }
+            continue;
+        }
+
+        n = recv(ev.data.fd, buf, len, MSG_DONTWAIT);
+        if (n < 0 && errno == EAGAIN)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            /* Peer hung up or reset the connection. It stays open until TransportHangup(),
+               so that its descriptor can't be reused while the caller remembers it */
+            epoll_ctl(t->epfd, EPOLL_CTL_DEL, ev.data.fd, NULL);
+            n = 0;
+        }
+        from->fd = ev.data.fd;
+        from->addrLen = 0;
+        return n;
+    }
+}
+
+ssize_t TransportSend(struct Transport *t, const void *buf, size_t len, const struct Peer *to, int flags)
+{
+    if (t->kind == TRANSPORT_UNIX)
+    {
+        return send(to->fd, buf, len, flags | MSG_NOSIGNAL);
+    }
+    return sendto(t->fd, buf, len, flags, (const struct sockaddr *)&to->addr, to->addrLen);
+}
+
+int TransportSendFd(const struct Transport *t, const struct Peer *p)
+{
+    return t->kind == TRANSPORT_UNIX ? p->fd : t->fd;
+}
+
+void TransportHangup(struct Transport *t, const struct Peer *p)
+{
+    if (t->kind == TRANSPORT_UNIX)
+    {
+        forget(t, p->fd);
+    }
+}
+
+int TransportPollFd(const struct Transport *t)
+{
+    return t->kind == TRANSPORT_UNIX ? t->epfd : t->fd;
+}
+
+void TransportClose(struct Transport *t)
+{
+    close(t->fd);
+    if (t->kind == TRANSPORT_UNIX)
+    {
+        close(t->epfd);
+        unlink(((struct sockaddr_un *)&t->ep.addr)->sun_path);
+    }
+}
+
+int PeerEqual(const struct Peer *a, const struct Peer *b)
+{
+    if (a->fd >= 0 || b->fd >= 0)
+    {
+        return a->fd == b->fd;
+    }
+    return a->addrLen == b->addrLen && memcmp(&a->addr, &b->addr, a->addrLen) == 0;
+}
+
+const char *PeerName(const struct Peer *p, char *buf, size_t len)
+{
+    if (p->fd >= 0)
+    {
+        snprintf(buf, len, "unix connection %d", p->fd);
+    }
+    else
+    {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)&p->addr;
+        snprintf(buf, len, "%s:%d", inet_ntoa(in->sin_addr), ntohs(in->sin_port));
+    }
+    return buf;
+}
@@ -0,0 +1,90 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <sys/socket.h> /* for sockaddr_storage and socklen_t */
+#include <sys/types.h>  /* for ssize_t */
+#include <pthread.h>    /* for pthread_mutex_t */
+
+#define TRANSPORT_UDP 0  /* PF_INET, SOCK_DGRAM, IPPROTO_UDP */
+#define TRANSPORT_UNIX 1 /* AF_UNIX, SOCK_SEQPACKET */
+
+#define UNIX_PREFIX "unix:"
+
+/* Where to bind or connect: "<IP> <Port>" or "unix:/path/to.sock" */
+struct Endpoint
+{
+    int kind;
+    struct sockaddr_storage addr;
+    socklen_t addrLen;
+};
+
+/* Server side of one endpoint */
+struct Transport
+{
+    int kind;
+    int fd;   /* UDP socket or SEQPACKET listening socket */
+    int epfd; /* SEQPACKET only: listening socket and accepted connections */
+    struct Endpoint ep;
+
+    /* SEQPACKET only: connections until TransportHangup(), whoever hangs up */
+    int *conns;
+    int connCount;
+    int connCap;
+    pthread_mutex_t connLock;
+};
+
+/* The other side of a message received by the server */
+struct Peer
+{
+    int fd; /* SEQPACKET connection, -1 for UDP */
+    struct sockaddr_storage addr;
+    socklen_t addrLen;
+};
+
+/* port may be "unix:/path", in which case ip is ignored */
+int ParseEndpoint(const char *ip, const char *port, struct Endpoint *ep);
+
+/* Returns a socket connected to ep, ready for send() and recv() */
+int TransportConnect(const struct Endpoint *ep);
+
+int TransportListen(struct Transport *t, const struct Endpoint *ep);
+
+/* Receive one message from any peer. flags may contain MSG_DONTWAIT.
+   0 means a SEQPACKET peer hung up; call TransportHangup() when done with it */
+ssize_t TransportRecv(struct Transport *t, void *buf, size_t len, struct Peer *from, int flags);
+
+/* flags may contain MSG_DONTWAIT */
+ssize_t TransportSend(struct Transport *t, const void *buf, size_t len, const struct Peer *to, int flags);
+
+/* Descriptor which becomes writable when TransportSend() to the peer may succeed */
+int TransportSendFd(const struct Transport *t, const struct Peer *p);
+
+/* Forget the peer. Closes its connection for SEQPACKET */
+void TransportHangup(struct Transport *t, const struct Peer *p);
+
+/* Descriptor which becomes readable when TransportRecv() has something */
+int TransportPollFd(const struct Transport *t);
+
+void TransportClose(struct Transport *t);
+
+/* Take over a bound socket received from another process */
+int TransportAdopt(struct Transport *t, const struct Endpoint *ep, int fd);
+
+/* Start receiving from a SEQPACKET connection received from another process */
+int TransportAdoptPeer(struct Transport *t, const struct Peer *p);
+
+/* Every connection accepted or adopted and not hung up on yet, to hand them
+   all over. Returns how many, with *fds a malloc()ed copy, or -1 */
+int TransportConnections(struct Transport *t, int **fds);
+
+/* Send a message over a Unix-domain socket together with descriptors (SCM_RIGHTS) */
+ssize_t SendWithFds(int sock, const void *buf, size_t len, const int *fds, int nfds);
+
+/* Receive such a message; *nfds is the room in fds on input and the number received on output */
+ssize_t RecvWithFds(int sock, void *buf, size_t len, int *fds, int *nfds);
+
+int PeerEqual(const struct Peer *a, const struct Peer *b);
+
+const char *PeerName(const struct Peer *p, char *buf, size_t len);
+
+#endif
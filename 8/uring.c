@@ -0,0 +1,175 @@
+#include <sys/syscall.h> /* for SYS_io_uring_setup, SYS_io_uring_enter, SYS_io_uring_register */
+#include <sys/mman.h>    /* for mmap() */
+#include <string.h>      /* for memset() */
+#include <stdlib.h>      /* for malloc() */
+#include <unistd.h>      /* for syscall() and close() */
+#include <stdatomic.h>
+#include <errno.h>
+
+#include "uring.h"
+
+int UringInit(struct Uring *u, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    if ((u->fd = syscall(SYS_io_uring_setup, entries, &p)) < 0)
+    {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG))
+    {
+        /* Too old a kernel, not worth supporting */
+        close(u->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    u->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (u->cqRingSize > u->sqRingSize)
+        u->sqRingSize = u->cqRingSize;
+    u->sqRing = mmap(NULL, u->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sqRing == MAP_FAILED)
+    {
+        close(u->fd);
+        return -1;
+    }
+    u->cqRing = u->sqRing; /* IORING_FEAT_SINGLE_MMAP */
+    u->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+    {
+        munmap(u->sqRing, u->sqRingSize);
+        close(u->fd);
+        return -1;
+    }
+
+    u->sqHead = (unsigned *)((char *)u->sqRing + p.sq_off.head);
+    u->sqTail = (unsigned *)((char *)u->sqRing + p.sq_off.tail);
+    u->sqMask = (unsigned *)((char *)u->sqRing + p.sq_off.ring_mask);
+    u->sqArray = (unsigned *)((char *)u->sqRing + p.sq_off.array);
+    u->cqHead = (unsigned *)((char *)u->cqRing + p.cq_off.head);
+    u->cqTail = (unsigned *)((char *)u->cqRing + p.cq_off.tail);
+    u->cqMask = (unsigned *)((char *)u->cqRing + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cqRing + p.cq_off.cqes);
+    return 0;
+}
+
+struct io_uring_sqe *UringSqe(struct Uring *u)
+{
+    unsigned head = atomic_load_explicit((_Atomic unsigned *)u->sqHead, memory_order_acquire);
+    unsigned tail = *u->sqTail + u->queued;
+    if (tail - head > *u->sqMask)
+    {
+        return NULL;
+    }
+    unsigned index = tail & *u->sqMask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sqArray[index] = index;
+    u->queued++;
+    return sqe;
+}
+
+int UringSubmit(struct Uring *u, int timeoutMs)
+{
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    unsigned submit = u->queued;
+
+    if (submit == 0 && timeoutMs == 0)
+    {
+        return 0;
+    }
+
+    /* Publish the new entries before the kernel looks at them */
+    atomic_store_explicit((_Atomic unsigned *)u->sqTail, *u->sqTail + u->queued, memory_order_release);
+    u->queued = 0;
+
+    memset(&arg, 0, sizeof(arg));
+    if (timeoutMs != 0)
+    {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+    if (timeoutMs > 0)
+    {
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+        arg.ts = (unsigned long)&ts;
+    }
+    if (syscall(SYS_io_uring_enter, u->fd, submit, timeoutMs != 0 ? 1 : 0, flags, &arg, sizeof(arg)) < 0 &&
+        errno != ETIME && errno != EINTR && errno != EBUSY)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+struct io_uring_cqe *UringPeek(struct Uring *u)
+{
+    unsigned head = *u->cqHead;
+    if (head == atomic_load_explicit((_Atomic unsigned *)u->cqTail, memory_order_acquire))
+    {
+        return NULL;
+    }
+    return &u->cqes[head & *u->cqMask];
+}
+
+void UringSeen(struct Uring *u)
+{
+    atomic_store_explicit((_Atomic unsigned *)u->cqHead, *u->cqHead + 1, memory_order_release);
+}
+
+int UringBufRingInit(struct Uring *u, struct UringBufRing *r, int group, unsigned count, unsigned size)
+{
+    struct io_uring_buf_reg reg;
+
+    r->count = count;
+    r->size = size;
+    r->group = group;
+    r->ring = mmap(NULL, count * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                   MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (r->ring == MAP_FAILED || (r->bufs = malloc((size_t)count * size)) == NULL)
+    {
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)r->ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (syscall(SYS_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        return -1;
+    }
+    r->ring->tail = 0;
+    for (unsigned bid = 0; bid < count; bid++)
+    {
+        UringBufReturn(r, bid);
+    }
+    return 0;
+}
+
+char *UringBuf(const struct UringBufRing *r, unsigned bid)
+{
+    return r->bufs + (size_t)bid * r->size;
+}
+
+void UringBufReturn(struct UringBufRing *r, unsigned bid)
+{
+    unsigned short tail = r->ring->tail;
+    struct io_uring_buf *buf = &r->ring->bufs[tail & (r->count - 1)];
+    buf->addr = (unsigned long)UringBuf(r, bid);
+    buf->len = r->size;
+    buf->bid = bid;
+    atomic_store_explicit((_Atomic unsigned short *)&r->ring->tail, tail + 1, memory_order_release);
+}
+
+void UringClose(struct Uring *u)
+{
+    munmap(u->sqes, u->sqesSize);
+    munmap(u->sqRing, u->sqRingSize);
+    close(u->fd);
+}
@@ -0,0 +1,63 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h> /* for io_uring_sqe, io_uring_cqe and io_uring_buf_ring */
+#include <stddef.h>         /* for size_t */
+
+/* Just enough io_uring for the server, straight on top of the system calls
+   (there is no liburing here). Single-threaded: one ring per thread */
+struct Uring
+{
+    int fd;
+    void *sqRing;
+    size_t sqRingSize;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned queued; /* Filled in but not submitted */
+    void *cqRing;
+    size_t cqRingSize;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+};
+
+/* Buffers the kernel picks from for multishot receives */
+struct UringBufRing
+{
+    struct io_uring_buf_ring *ring;
+    char *bufs;
+    unsigned count; /* Power of two */
+    unsigned size;
+    int group;
+};
+
+/* -1 with errno if io_uring is not available */
+int UringInit(struct Uring *u, unsigned entries);
+
+/* Next free submission entry, zeroed. NULL if the queue is full until UringSubmit() */
+struct io_uring_sqe *UringSqe(struct Uring *u);
+
+/* Submit everything filled in and wait for at least one completion,
+   or timeoutMs (-1 forever, 0 not at all) */
+int UringSubmit(struct Uring *u, int timeoutMs);
+
+/* Next completion, NULL if none. UringSeen() once done with it */
+struct io_uring_cqe *UringPeek(struct Uring *u);
+
+void UringSeen(struct Uring *u);
+
+int UringBufRingInit(struct Uring *u, struct UringBufRing *r, int group, unsigned count, unsigned size);
+
+char *UringBuf(const struct UringBufRing *r, unsigned bid);
+
+/* Hand a buffer back to the kernel */
+void UringBufReturn(struct UringBufRing *r, unsigned bid);
+
+void UringClose(struct Uring *u);
+
+#endif